@@ -11,11 +11,15 @@
 #include <list>
 
 
-chfs_client::chfs_client(std::string extent_dst)
+chfs_client::chfs_client(std::string extent_dst, bool writeback)
 {
-    ec = new extent_client(extent_dst);
-    if (ec->put(1, "") != extent_protocol::OK)
-        printf("error init root dir\n"); // XYB: init root dir
+    ec = new extent_client(extent_dst, writeback);
+    // XYB: init root dir, unless it survived on a persistent disk
+    extent_protocol::attr a;
+    if (ec->getattr(1, a) != extent_protocol::OK)
+        printf("error init root dir\n");
+    else if (a.size == 0 && ec->put(1, "") != extent_protocol::OK)
+        printf("error init root dir\n");
 }
 
 chfs_client::inum
@@ -165,29 +169,326 @@ release:
     } \
 } while (0)
 
+// Each directory entry is an 8-byte inum and a 1-byte name length,
+// followed by the name.
+#define DIRENT_HDR (sizeof(chfs_client::inum) + 1)
+
+/* Return the offset of the entry for name among the entries in
+ * blk[start, end), or 0 if there is none. */
+static uint32_t
+dirent_find(const std::string &blk, uint32_t start, uint32_t end,
+            const char *name, size_t len)
+{
+    for (uint32_t pos = start; pos < end; ) {
+        size_t elen = (unsigned char) blk[pos + DIRENT_HDR - 1];
+        if (elen == len && memcmp(&blk[pos + DIRENT_HDR], name, len) == 0)
+            return pos;
+        pos += DIRENT_HDR + elen;
+    }
+    return 0;
+}
+
+/* FNV-1a hash of a file name. */
+uint32_t
+chfs_client::dir_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name; ++name) {
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Read the header of directory dir.
+ * An empty directory gets a header with magic 0. */
+int
+chfs_client::dir_get_header(inum dir, dir_header &h)
+{
+    std::string buf;
+
+    if (ec->read(dir, 0, sizeof(h), buf) != extent_protocol::OK) {
+        printf("Error: Can't read dir %lld\n", dir);
+        return IOERR;
+    }
+    if (buf.size() == 0) {
+        memset(&h, 0, sizeof(h));
+        return OK;
+    }
+    if (buf.size() != sizeof(h)) {
+        printf("Error: dir %lld is truncated\n", dir);
+        return IOERR;
+    }
+    memcpy(&h, buf.data(), sizeof(h));
+    if (h.magic != DIR_MAGIC || h.nbuckets == 0) {
+        printf("Error: dir %lld has a bad header\n", dir);
+        return IOERR;
+    }
+    return OK;
+}
+
+int
+chfs_client::dir_read_block(inum dir, uint32_t b, std::string &blk)
+{
+    if (ec->read(dir, b * DIR_BLOCK, DIR_BLOCK, blk) != extent_protocol::OK
+        || blk.size() != DIR_BLOCK) {
+        printf("Error: Can't read block %u of dir %lld\n", b, dir);
+        return IOERR;
+    }
+    return OK;
+}
+
+/* Queue a write of block b of dir onto ops; patch marks where the
+ * inum of a file created by the same compound call goes, if any. */
+void
+chfs_client::dir_write_block(std::vector<extent_protocol::op> &ops, inum dir,
+                             uint32_t b, const std::string &blk, int patch)
+{
+    ops.push_back(extent_protocol::op(extent_protocol::write, dir, b * DIR_BLOCK,
+                                      blk, patch));
+}
+
+/* Look name up in dir: read the header and walk one bucket chain. */
+int
+chfs_client::dir_find(inum dir, const char *name, bool &found, inum &ino_out)
+{
+    dir_header h;
+    dir_block db;
+    std::string blk;
+    size_t len = strlen(name);
+    int r;
+
+    found = false;
+    if ((r = dir_get_header(dir, h)) != OK || h.magic == 0)
+        return r;
+
+    for (uint32_t b = 1 + dir_hash(name) % h.nbuckets; b != 0; b = db.next) {
+        if ((r = dir_read_block(dir, b, blk)) != OK)
+            return r;
+        memcpy(&db, blk.data(), sizeof(db));
+        uint32_t pos = dirent_find(blk, sizeof(db), sizeof(db) + db.used, name, len);
+        if (pos != 0) {
+            memcpy(&ino_out, &blk[pos], sizeof(inum));
+            found = true;
+            break;
+        }
+    }
+    return OK;
+}
+
+/* Add the entry name -> ino to dir, which must not hold name yet.
+ * Only the block that takes the entry is rewritten, plus the header
+ * and the previous block of the chain if an overflow block is added;
+ * these writes are queued onto ops.  An ino of 0 stands for the file
+ * created earlier in ops.  If the table has to grow, the rebuilt
+ * directory with the entry in it is queued instead. */
+int
+chfs_client::dir_add(inum dir, const char *name, inum ino,
+                     std::vector<extent_protocol::op> &ops)
+{
+    dir_header h;
+    dir_block db;
+    std::string blk;
+    size_t len = strlen(name);
+    uint32_t need = DIRENT_HDR + len;
+    uint32_t b;
+    int r;
+
+    if (len == 0 || len > 255) {
+        printf("Error: bad file name length %zu\n", len);
+        return IOERR;
+    }
+    if ((r = dir_get_header(dir, h)) != OK)
+        return r;
+    if (h.magic == 0)
+        return dir_rehash(dir, 1, name, ino, ops);
+
+    /* Append to the first block of the chain with room */
+    std::string ent(DIRENT_HDR, '\0');
+    memcpy(&ent[0], &ino, sizeof(inum));
+    ent[DIRENT_HDR - 1] = (char) len;
+    ent.append(name, len);
+    for (b = 1 + dir_hash(name) % h.nbuckets; ; b = db.next) {
+        if ((r = dir_read_block(dir, b, blk)) != OK)
+            return r;
+        memcpy(&db, blk.data(), sizeof(db));
+        if (sizeof(db) + db.used + need <= DIR_BLOCK) {
+            int pos = sizeof(db) + db.used;
+            blk.replace(pos, need, ent);
+            db.used += need;
+            db.count++;
+            memcpy(&blk[0], &db, sizeof(db));
+            dir_write_block(ops, dir, b, blk, ino ? -1 : pos);
+            return OK;
+        }
+        if (db.next == 0)
+            break;
+    }
+
+    /* The chain is full: double the buckets once there are as many
+     * overflow blocks as buckets, else chain a new overflow block */
+    if (h.nblocks - 1 - h.nbuckets >= h.nbuckets)
+        return dir_rehash(dir, h.nbuckets * 2, name, ino, ops);
+
+    std::string fresh(DIR_BLOCK, '\0');
+    dir_block fdb = { 0, (uint16_t) need, 1 };
+    memcpy(&fresh[0], &fdb, sizeof(fdb));
+    fresh.replace(sizeof(fdb), need, ent);
+    uint32_t nb = h.nblocks++;
+    dir_write_block(ops, dir, nb, fresh, ino ? -1 : (int) sizeof(fdb));
+    ops.push_back(extent_protocol::op(extent_protocol::write, dir, 0,
+                                      std::string((const char *) &h, sizeof(h))));
+    db.next = nb;
+    memcpy(&blk[0], &db, sizeof(db));
+    dir_write_block(ops, dir, b, blk);
+    return OK;
+}
+
+/* Remove the entry for name from dir, rewriting only its block;
+ * the write is queued onto ops. */
+int
+chfs_client::dir_remove(inum dir, const char *name,
+                        std::vector<extent_protocol::op> &ops)
+{
+    dir_header h;
+    dir_block db;
+    std::string blk;
+    size_t len = strlen(name);
+    int r;
+
+    if ((r = dir_get_header(dir, h)) != OK)
+        return r;
+    if (h.magic == 0)
+        return NOENT;
+
+    for (uint32_t b = 1 + dir_hash(name) % h.nbuckets; b != 0; b = db.next) {
+        if ((r = dir_read_block(dir, b, blk)) != OK)
+            return r;
+        memcpy(&db, blk.data(), sizeof(db));
+        uint32_t pos = dirent_find(blk, sizeof(db), sizeof(db) + db.used, name, len);
+        if (pos != 0) {
+            blk.erase(pos, DIRENT_HDR + len);
+            blk.append(DIRENT_HDR + len, '\0');
+            db.used -= DIRENT_HDR + len;
+            db.count--;
+            memcpy(&blk[0], &db, sizeof(db));
+            dir_write_block(ops, dir, b, blk);
+            return OK;
+        }
+    }
+    return NOENT;
+}
+
+/* Append every entry of dir to list. */
+int
+chfs_client::dir_list(inum dir, std::list<dirent> &list)
+{
+    dir_header h;
+    dir_block db;
+    std::string buf;
+
+    if (ec->get(dir, buf) != extent_protocol::OK) {
+        printf("Error: Can't read dir %lld\n", dir);
+        return IOERR;
+    }
+    if (buf.size() == 0)
+        return OK;
+    memcpy(&h, buf.data(), sizeof(h));
+    if (h.magic != DIR_MAGIC || buf.size() < (size_t) h.nblocks * DIR_BLOCK) {
+        printf("Error: dir %lld has a bad header\n", dir);
+        return IOERR;
+    }
+
+    for (uint32_t b = 1; b < h.nblocks; ++b) {
+        const char *blk = buf.data() + b * DIR_BLOCK;
+        memcpy(&db, blk, sizeof(db));
+        for (uint32_t pos = sizeof(db); pos < sizeof(db) + db.used; ) {
+            struct dirent d;
+            size_t elen = (unsigned char) blk[pos + DIRENT_HDR - 1];
+            memcpy(&d.inum, blk + pos, sizeof(inum));
+            d.name.assign(blk + pos + DIRENT_HDR, elen);
+            list.push_back(d);
+            pos += DIRENT_HDR + elen;
+        }
+    }
+    return OK;
+}
+
+/* Rebuild dir as a table of nbuckets buckets holding its entries plus
+ * name -> ino, and queue a put of the whole directory onto ops.  This
+ * rewrites the whole directory, but it happens only each time the
+ * directory doubles in size. */
+int
+chfs_client::dir_rehash(inum dir, uint32_t nbuckets, const char *name, inum ino,
+                        std::vector<extent_protocol::op> &ops)
+{
+    std::list<dirent> entries;
+    dir_header h;
+    int patch = -1;
+    int r;
+
+    if ((r = dir_list(dir, entries)) != OK)
+        return r;
+    struct dirent d;
+    d.inum = ino;
+    d.name = name;
+    entries.push_back(d);
+
+    std::vector<std::string> blocks(nbuckets + 1, std::string(DIR_BLOCK, '\0'));
+    for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        uint32_t need = DIRENT_HDR + it->name.size();
+        dir_block db;
+        uint32_t b = 1 + dir_hash(it->name.c_str()) % nbuckets;
+        for (;;) {
+            memcpy(&db, blocks[b].data(), sizeof(db));
+            if (sizeof(db) + db.used + need <= DIR_BLOCK)
+                break;
+            if (db.next == 0) {
+                db.next = blocks.size();
+                memcpy(&blocks[b][0], &db, sizeof(db));
+                blocks.push_back(std::string(DIR_BLOCK, '\0'));
+            }
+            b = db.next;
+        }
+        char *ent = &blocks[b][sizeof(db) + db.used];
+        if (ino == 0 && std::next(it) == entries.end())
+            patch = b * DIR_BLOCK + sizeof(db) + db.used;
+        memcpy(ent, &it->inum, sizeof(inum));
+        ent[DIRENT_HDR - 1] = (char) it->name.size();
+        memcpy(ent + DIRENT_HDR, it->name.data(), it->name.size());
+        db.used += need;
+        db.count++;
+        memcpy(&blocks[b][0], &db, sizeof(db));
+    }
+
+    h.magic = DIR_MAGIC;
+    h.nbuckets = nbuckets;
+    h.nblocks = blocks.size();
+    h.pad = 0;
+    memcpy(&blocks[0][0], &h, sizeof(h));
+
+    std::string buf;
+    buf.reserve(blocks.size() * DIR_BLOCK);
+    for (size_t i = 0; i < blocks.size(); ++i)
+        buf += blocks[i];
+    ops.push_back(extent_protocol::op(extent_protocol::put, dir, 0, buf, patch));
+    return OK;
+}
+
 // Only support set size of attr
 int
 chfs_client::setattr(inum ino, size_t size)
 {
     int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(ino));
 
     /*
      * your code goes here.
-     * note: get the content of inode ino, and modify its content
-     * according to the size (<, =, or >) content length.
+     * note: the server frees or adds blocks at the end of the file
+     * in place, without the content going over the wire.
      */
-    std::string buf;
-
-    if (ec->get(ino, buf) != extent_protocol::OK) {
-        printf("Error: Can't read file (ino %d)\n", ino);
-        r = NOENT;
-        return r;
-    }
-
-    buf.resize(size);
-
-    if (ec->put(ino, buf) != extent_protocol::OK) {
-        printf("Error: Can't write file (ino %d)\n", ino);
+    if (ec->truncate(ino, size) != extent_protocol::OK) {
+        printf("Error: Can't set file size (ino %d)\n", ino);
         r = NOENT;
     }
 
@@ -198,47 +499,40 @@ int
 chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
     int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(parent));
 
     /*
      * your code goes here.
      * note: lookup is what you need to check if file exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    std::string buf;
     inum file_inum = 0;
     bool found = false;
 
-    if (ec->get(parent, buf) != extent_protocol::OK) {
+    if ((r = do_lookup(parent, name, found, file_inum)) != OK) {
         printf("Error: Can't find parent dir %d\n", parent);
-        r = IOERR;
         return r;
     }
-    
-    lookup(parent, name, found, file_inum);
     if (found) {
         printf("Error: file %s already exists\n", name);
         r = EXIST;
         return r;
     }
 
-    if (ec->create(extent_protocol::T_FILE, file_inum) != extent_protocol::OK) {
-        printf("Error: Can't create inode for new file\n");
+    /* Make the inode and its entry in one compound call */
+    std::vector<extent_protocol::op> ops;
+    ops.push_back(extent_protocol::op(extent_protocol::create, 0, extent_protocol::T_FILE));
+    if (dir_add(parent, name, 0, ops) != OK) {
+        printf("Error: Update for dir in creating new file failed\n");
         r = IOERR;
         return r;
     }
-
-    ino_out = file_inum;
-    std::string file_name(name);
-    buf += file_name + '/' + filename(file_inum) + '/';
-    // printf("print buf: ");
-    // for (int i = 0; i < buf.size(); ++i) {
-    //     std::cout << buf[i];
-    // }
-    // std::cout << "\n";
-    if (ec->put(parent, buf) != extent_protocol::OK) {
-        printf("Error: Update for dir in creating new file failed\n");
+    if (ec->compound(ops, file_inum) != extent_protocol::OK) {
+        printf("Error: Can't create inode for new file\n");
         r = IOERR;
+        return r;
     }
+    ino_out = file_inum;
     printf("creaaaaaaaaaaate file->parent: %d, name: %s, inum: %d\n", parent, name, file_inum);
     return r;
 }
@@ -247,46 +541,41 @@ int
 chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
     int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(parent));
 
     /*
      * your code goes here.
      * note: lookup is what you need to check if directory exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    std::string buf;
     inum dir_inum = 0;
     bool isFound = false;
 
-    /* Get parent dir content */
-    if (ec->get(parent, buf) != extent_protocol::OK) {
+    /* Check if dir already exists */
+    if ((r = do_lookup(parent, name, isFound, dir_inum)) != OK) {
         printf("Error: Can't find parent dir %d\n", parent);
-        r = IOERR;
         return r;
     }
-
-    /* Check if dir already exists */
-    lookup(parent, name, isFound, dir_inum);
     if (isFound) {
         printf("Error: Directory %s already exists\n", name);
         r = EXIST;
         return r;
     }
 
-    /* Create directory */
-    if (ec->create(extent_protocol::T_DIR, dir_inum) != extent_protocol::OK) {
-        printf("Error: Can't create directory %s\n", name);
+    /* Create directory and update parent dir's content at once */
+    std::vector<extent_protocol::op> ops;
+    ops.push_back(extent_protocol::op(extent_protocol::create, 0, extent_protocol::T_DIR));
+    if (dir_add(parent, name, 0, ops) != OK) {
+        printf("Error: Update for dir in creating new dir failed\n");
         r = IOERR;
         return r;
-    } 
-
-    /* Update parent dir's content */
-    ino_out = dir_inum;
-    std::string dirname(name);
-    buf += dirname + '/' + filename(dir_inum) + '/';
-    if (ec->put(parent, buf) != extent_protocol::OK) {
-        printf("Error: Update for dir in creating new dir failed\n");
+    }
+    if (ec->compound(ops, dir_inum) != extent_protocol::OK) {
+        printf("Error: Can't create directory %s\n", name);
         r = IOERR;
+        return r;
     }
+    ino_out = dir_inum;
     printf("Mkkkkkkkkkkkkkkkkkkdir->parent: %d, name: %s, inum: %d\n", parent, name, dir_inum);
 
     return r;
@@ -294,6 +583,13 @@ chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 
 int
 chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
+{
+    std::shared_lock<std::shared_mutex> lock(inode_lock(parent));
+    return do_lookup(parent, name, found, ino_out);
+}
+
+int
+chfs_client::do_lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
     int r = OK;
 
@@ -301,46 +597,19 @@ chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
      * your code goes here.
      * note: lookup file from parent dir according to name;
      * you should design the format of directory content.
+     * see dir_find: only the header and one bucket chain are read.
      */
-    std::string buf;
-    int cur_pos;
-    int stop_pos;
-    int end_pos;
-
-    if (ec->get(parent, buf) != extent_protocol::OK) {
-        printf("Error: Can't find parent dir %d\n", parent);
-        r = IOERR;
-        return r;
-    }
+    found = false;
     if (!isdir(parent)) {
         printf("Erro: inode %d is not a dir\n", parent);
         r = NOENT;
         return r;
     }
 
-    cur_pos = 0;
-    stop_pos = 0;
-    end_pos = buf.size();
-    found = false;
-    // printf("buf: %s\n", buf.data());
-    while (cur_pos < end_pos) {
-        while (buf[stop_pos] != '/') ++stop_pos;
-        std::string file_name = buf.substr(cur_pos, stop_pos - cur_pos);
-        cur_pos = ++stop_pos;
-        // printf("filennnnnnnnnnnnnnnnnnnnname: %s\n", file_name);
-
-        while (buf[stop_pos] != '/') ++stop_pos;
-        std::string file_inum = buf.substr(cur_pos, stop_pos - cur_pos);
-        cur_pos = ++stop_pos;
-
-        // printf("looooooooooook up in filename: %s, inum: %d. We need: %s\n", file_name, n2i(file_inum), name);
-        if (file_name.compare(name) == 0) {
-            found = true;
-            ino_out = n2i(file_inum);
-            // printf("Succeessfullyyyyyyyyyyyyyyyyyyyyyyy lookup->filname: %s, inum: %d\n", file_name, file_inum);
-            break;
-        }
-
+    if (dir_find(parent, name, found, ino_out) != OK) {
+        printf("Error: Can't find parent dir %d\n", parent);
+        r = IOERR;
+        return r;
     }
     printf("loooooooooook up-> parent: %d, name: %s, found: %d, ino_out: %d\n", parent, name, found, ino_out);
 
@@ -349,6 +618,13 @@ chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 
 int
 chfs_client::readdir(inum dir, std::list<dirent> &list)
+{
+    std::shared_lock<std::shared_mutex> lock(inode_lock(dir));
+    return do_readdir(dir, list);
+}
+
+int
+chfs_client::do_readdir(inum dir, std::list<dirent> &list)
 {
     int r = OK;
 
@@ -357,66 +633,77 @@ chfs_client::readdir(inum dir, std::list<dirent> &list)
      * note: you should parse the dirctory content using your defined format,
      * and push the dirents to the list.
      */
-    std::string buf;
-    int cur_pos;
-    int stop_pos;
-    int end_pos;
-
-    if (ec->get(dir, buf) != extent_protocol::OK) {
-        printf("Error: Can't find parent dir %d\n", dir);
-        r = IOERR;
-        return r;
-    }
     if (!isdir(dir)) {
         printf("Error: inode %d is not a dir\n", dir);
         r = NOENT;
         return r;
     }
 
-    cur_pos = 0;
-    stop_pos = 0;
-    end_pos = buf.size();
-    while (cur_pos < end_pos) {
-        while (buf[stop_pos] != '/') ++stop_pos;
-        std::string file_name = buf.substr(cur_pos, stop_pos - cur_pos);
-        cur_pos = ++stop_pos;
+    if (dir_list(dir, list) != OK) {
+        printf("Error: Can't find parent dir %d\n", dir);
+        r = IOERR;
+        return r;
+    }
+    printf("reeeeeeeeeeeeeeeeeeeaddir->\n");
+    return r;
+}
+
+/* readdir, plus the attributes of every entry, fetched in one
+ * getattr_many call.  They stay cached under their leases, so the
+ * lookups and getattrs that usually follow a listing are local. */
+int
+chfs_client::readdir_plus(inum dir, std::list<dirent_plus> &list)
+{
+    std::list<dirent> entries;
+    std::vector<extent_protocol::extentid_t> ids;
+    std::vector<extent_protocol::attr> attrs;
+    int r;
+    std::shared_lock<std::shared_mutex> lock(inode_lock(dir));
 
-        while (buf[stop_pos] != '/') ++stop_pos;
-        std::string file_inum = buf.substr(cur_pos, stop_pos - cur_pos);
-        cur_pos = ++stop_pos;
+    if ((r = do_readdir(dir, entries)) != OK)
+        return r;
 
-        struct dirent d;
-        d.name = file_name;
-        d.inum = n2i(file_inum);
+    for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); ++it)
+        ids.push_back(it->inum);
+    if (ec->getattr_many(ids, attrs) != extent_protocol::OK) {
+        printf("Error: Can't get attributes of dir %lld\n", dir);
+        return IOERR;
+    }
+
+    size_t i = 0;
+    for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); ++it, ++i) {
+        dirent_plus d;
+        d.name.swap(it->name);
+        d.inum = it->inum;
+        d.attr = attrs[i];
         list.push_back(d);
     }
-    printf("reeeeeeeeeeeeeeeeeeeaddir->\n");
-    return r;
+    return OK;
 }
 
 int
 chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
     int r = OK;
+    std::shared_lock<std::shared_mutex> lock(inode_lock(ino));
 
     /*
      * your code goes here.
-     * note: read using ec->get().
+     * note: read only the requested range using ec->read().
      */
-    std::string buf;
-
     printf("Reeeeeeeeeeeead inum: %d, size: %d, off: %d\n", ino, size, off);
-    if (ec->get(ino, buf) != extent_protocol::OK) {
+    // Extent offsets are 32 bits and no file reaches past them
+    if (off < 0 || (uint64_t) off >= UINT32_MAX) {
+        data.clear();
+        return r;
+    }
+    size = std::min<uint64_t>(size, UINT32_MAX - off);
+    if (ec->read(ino, off, size, data) != extent_protocol::OK) {
         printf("Error: Can't read file (ino %d)\n", ino);
         r = NOENT;
         return r;
     }
 
-    // printf("buf: %s buf size: %d\n", buf.c_str(), buf.size());
-    int buf_size = buf.size();
-    data = buf.substr(off, size);
-    // printf("Reeeeeeeeeeed-> data: %s data size: %d\n", data.c_str(), data.size());
-
     return r;
 }
 
@@ -425,28 +712,64 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
 {
     int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(ino));
 
     /*
      * your code goes here.
-     * note: write using ec->put().
-     * when off > length of original file, fill the holes with '\0'.
+     * note: write only the affected range using ec->write();
+     * the server fills holes past the end of file with '\0'.
+     * In write-back mode the range is only buffered, see flush().
      */
-    std::string buf;
-
-    printf("Wriiiiiiiiiiiiiiiiite: inum: %d, size: %d, offset: %d, data: %s\n", ino, size, off, data);
-    if (ec->get(ino, buf) != extent_protocol::OK) {
-        printf("Error: Can't read file (ino %d)\n", ino);
-        r = NOENT;
-        return r;
-    }
-    if (buf.size() < off) {
-        buf.resize(off, '\0');
+    printf("Wriiiiiiiiiiiiiiiiite: inum: %d, size: %d, offset: %d\n", ino, size, off);
+    if (off < 0 || (uint64_t) off + size > UINT32_MAX) {
+        printf("Error: write past the largest file (inum: %d)\n", ino);
+        return IOERR;
     }
-    buf.replace(off, size, data, size);
-    bytes_written = size;
-    if (ec->put(ino, buf) != extent_protocol::OK) {
+    bytes_written = 0;
+    if (ec->write_buffered(ino, off, std::string(data, size)) != extent_protocol::OK) {
         printf("Error: Can't write back to files (inum: %d)\n", ino);
         r = NOENT;
+    } else {
+        bytes_written = size;
+    }
+
+    return r;
+}
+
+// Note that ino is being opened; unchanged tells whether its contents
+// are the same as at its previous open.
+int
+chfs_client::open(inum ino, bool &unchanged)
+{
+    extent_protocol::attr a;
+
+    unchanged = false;
+    if (ec->getattr(ino, a) != extent_protocol::OK) {
+        printf("Error: Can't get attr of file (inum: %lld)\n", ino);
+        return IOERR;
+    }
+
+    file_version v = { a.mtime, a.ctime, a.size };
+    std::lock_guard<std::mutex> lock(versions_mtx);
+    std::map<inum, file_version>::iterator it = versions.find(ino);
+    if (it != versions.end()) {
+        unchanged = it->second.mtime == v.mtime && it->second.ctime == v.ctime
+            && it->second.size == v.size;
+    }
+    versions[ino] = v;
+    return OK;
+}
+
+// Send the file's buffered writes to the extent server (fsync, close).
+int
+chfs_client::flush(inum ino)
+{
+    int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(ino));
+
+    if (ec->flush(ino) != extent_protocol::OK) {
+        printf("Error: Can't flush file (inum: %d)\n", ino);
+        r = IOERR;
     }
 
     return r;
@@ -455,64 +778,41 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
 int chfs_client::unlink(inum parent,const char *name)
 {
     int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(parent));
 
     /*
      * your code goes here.
      * note: you should remove the file using ec->remove,
      * and update the parent directory content.
      */
-    std::string buf;
     inum file_inum = 0;
     bool isFound = false;
 
-    /* Get parent dir content */
-    if (ec->get(parent, buf) != extent_protocol::OK) {
-        printf("Error: Can't find parent dir %d\n", parent);
-        r = IOERR;
-        return r;
-    }
-    printf("Unnnnnnnnnnnnnnnnnnnnnnnnlink-> prev buf: %s\n", buf.c_str());
+    printf("Unnnnnnnnnnnnnnnnnnnnnnnnlink-> parent: %lld, name: %s\n", parent, name);
 
     /* Check if the file already exists */
-    lookup(parent, name, isFound, file_inum);
+    do_lookup(parent, name, isFound, file_inum);
     if (!isFound) {
         printf("Error: Can't find file %s\n", name);
         r = IOERR;
         return r;
     }
 
-    /* Delete file */
-    if (ec->remove(file_inum) != extent_protocol::OK) {
-        printf("Error: Can't delete file: %s\n", name);
+    /* Update parent dir and delete file in one compound call */
+    std::vector<extent_protocol::op> ops;
+    if (dir_remove(parent, name, ops) != OK) {
+        printf("Error: Can't update parent dir content!\n");
         r = IOERR;
         return r;
     }
-
-    /* Update parent dir */
-    int cur_pos = 0;
-    int stop_pos = 0;
-    int end_pos = buf.size();
-    while (cur_pos < end_pos) {
-        while (buf[stop_pos] != '/') ++stop_pos;
-        std::string file_name = buf.substr(cur_pos, stop_pos - cur_pos);
-        ++stop_pos;
-        /* Filename matched: erase 'filename/inum/' */
-        if (file_name.compare(name) == 0) {
-            while (buf[stop_pos] != '/') ++stop_pos;
-            buf.erase(cur_pos, stop_pos - cur_pos + 1);
-            break;
-        }
-        /* Else: Skip inum and move forward */
-        else {
-            while (buf[stop_pos] != '/') ++stop_pos;
-            cur_pos = ++stop_pos;
-        }
-    }
-    if (ec->put(parent, buf) != extent_protocol::OK) {
-        printf("Error: Can't update parent dir content!\n");
+    ops.push_back(extent_protocol::op(extent_protocol::remove, file_inum));
+    extent_protocol::extentid_t none;
+    if (ec->compound(ops, none) != extent_protocol::OK) {
+        printf("Error: Can't delete file: %s\n", name);
         r = IOERR;
     }
-    // printf("Unnnnnnnnnnnnnnnnnnlink-> next buf: %s\n", buf.c_str());
+    std::lock_guard<std::mutex> vlock(versions_mtx);
+    versions.erase(file_inum);
 
     return r;
 }
@@ -521,52 +821,40 @@ int
 chfs_client::symlink(const char *link, inum parent, const char *name, inum &ino_out)
 {
     int r = OK;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(parent));
     inum inum;
     bool found = false;
-    std::string buf;
 
     printf("symmmmmmmmmmmmlink-> link: %s, parent: %d, name: %s\n", link, parent, name);
     
-    /* Check parent dir */
-    if (ec->get(parent, buf) != extent_protocol::OK) {
+    /* Check if symlink already exists */
+    if ((r = do_lookup(parent, name, found, inum)) != OK) {
         printf("Error: Can't open parent directory %d\n", parent);
-        r = IOERR;
         return r;
     }
-
-    /* Check if symlink already exists */
-    lookup(parent, name, found, inum);
     if (found) {
         printf("Error: symlink %s already exists!\n", name);
         r = EXIST;
         return r;
     }
 
-    /* Create inode for symlink */
-    if (ec->create(extent_protocol::T_SYM, inum) != extent_protocol::OK) {
-        printf("Error: Can't create inode for symlink %s\n", name);
+    /* Create the inode, input the contents of the symbolic link
+     * and update parent dir in one compound call */
+    std::vector<extent_protocol::op> ops;
+    ops.push_back(extent_protocol::op(extent_protocol::create, 0, extent_protocol::T_SYM));
+    ops.push_back(extent_protocol::op(extent_protocol::put, 0, 0, std::string(link)));
+    if (dir_add(parent, name, 0, ops) != OK) {
+        printf("Error: Can't update parent dir!\n");
         r = IOERR;
         return r;
     }
-    printf("Create inode: %d for symlink %s -> %s\n", inum, name, link);
-    ino_out = inum;
-    
-
-    /* Input the contents of the symbolic link */
-    if (ec->put(inum, std::string(link)) != extent_protocol::OK) {
-        printf("Error: Can't write link to inode\n");
+    if (ec->compound(ops, inum) != extent_protocol::OK) {
+        printf("Error: Can't create inode for symlink %s\n", name);
         r = IOERR;
         return r;
     }
-
-    issymlink(inum);
-
-    /* Update parent dir and commit */
-    buf += std::string(name) + '/' + filename(inum) + '/';
-    if (ec->put(parent, buf) != extent_protocol::OK) {
-        printf("Error: Can't update parent dir!\n");
-        r = IOERR;
-    }
+    printf("Create inode: %d for symlink %s -> %s\n", inum, name, link);
+    ino_out = inum;
 
     return r;
 
@@ -576,6 +864,7 @@ int
 chfs_client::readlink(inum inum, std::string &data)
 {
     int r = OK;
+    std::shared_lock<std::shared_mutex> lock(inode_lock(inum));
 
     // printf("Reeeeeeeeeeeeeeeeeeeeadlink!\n");
     if (ec->get(inum, data) != extent_protocol::OK) {
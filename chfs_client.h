@@ -5,6 +5,10 @@
 //#include "chfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
 
 
 class chfs_client {
@@ -36,6 +40,11 @@ class chfs_client {
     std::string name;
     chfs_client::inum inum;
   };
+  struct dirent_plus {
+    std::string name;
+    chfs_client::inum inum;
+    extent_protocol::attr attr;
+  };
   struct syminfo {
     std::string slink;
     unsigned long long size;
@@ -48,8 +57,66 @@ class chfs_client {
   static std::string filename(inum);
   static inum n2i(std::string);
 
+  /*
+   * Directory format: a hash table of DIR_BLOCK-byte blocks.
+   * Block 0 holds a dir_header and bucket i starts at block i + 1;
+   * a full bucket chains into overflow blocks appended at the end.
+   * Each block is a dir_block followed by entries of an 8-byte inum,
+   * a 1-byte name length and the name.  An empty directory file has
+   * no entries.
+   */
+  enum { DIR_MAGIC = 0x63686431, DIR_BLOCK = 512 };
+  struct dir_header {
+    uint32_t magic;
+    uint32_t nbuckets;
+    uint32_t nblocks;   // blocks in use, header and overflow included
+    uint32_t pad;
+  };
+  struct dir_block {
+    uint32_t next;      // next block of the bucket chain, 0 at the end
+    uint16_t used;      // bytes of entries after this header
+    uint16_t count;
+  };
+
+  static uint32_t dir_hash(const char *);
+  int dir_get_header(inum, dir_header &);
+  int dir_read_block(inum, uint32_t, std::string &);
+  void dir_write_block(std::vector<extent_protocol::op> &, inum, uint32_t,
+                       const std::string &, int patch = -1);
+  int dir_find(inum, const char *, bool &, inum &);
+  int dir_add(inum, const char *, inum, std::vector<extent_protocol::op> &);
+  int dir_remove(inum, const char *, std::vector<extent_protocol::op> &);
+  int dir_list(inum, std::list<dirent> &);
+  int dir_rehash(inum, uint32_t, const char *, inum,
+                 std::vector<extent_protocol::op> &);
+
+  /*
+   * Per-inode reader/writer locks, for the FUSE threads.  Operations
+   * that only read an inode take its lock shared, ones that change it
+   * take it exclusive; each operation holds a single lock.  The table
+   * is striped, so an inode shares its lock with others in its slot.
+   */
+  enum { NINODE_LOCKS = 256 };
+  std::shared_mutex inode_locks[NINODE_LOCKS];
+  std::shared_mutex &inode_lock(inum ino) { return inode_locks[ino % NINODE_LOCKS]; }
+
+  /*
+   * Version of each opened file's contents as seen at its last open,
+   * so open() can tell whether the kernel's cached pages are current.
+   */
+  struct file_version {
+    unsigned int mtime;
+    unsigned int ctime;
+    unsigned int size;
+  };
+  std::mutex versions_mtx;
+  std::map<inum, file_version> versions;
+
+  int do_lookup(inum, const char *, bool &, inum &);
+  int do_readdir(inum, std::list<dirent> &);
+
  public:
-  chfs_client(std::string);
+  chfs_client(std::string, bool writeback = false);
 
   bool isfile(inum);
   bool isdir(inum);
@@ -64,8 +131,11 @@ class chfs_client {
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &);
   int readdir(inum, std::list<dirent> &);
+  int readdir_plus(inum, std::list<dirent_plus> &);
   int write(inum, size_t, off_t, const char *, size_t &);
   int read(inum, size_t, off_t, std::string &);
+  int flush(inum);
+  int open(inum, bool &);
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
   
@@ -3,13 +3,17 @@
 chfs_command_raft::chfs_command_raft() {
     // Lab3: Your code here
     cmd_tp = CMD_NONE;
+    off = 0;
+    len = 0;
     res = std::make_shared<result>();
     res->done = false;
+    res->ret = extent_protocol::OK;
     res->start = std::chrono::system_clock::now();
 }
 
 chfs_command_raft::chfs_command_raft(const chfs_command_raft &cmd) :
-    cmd_tp(cmd.cmd_tp), type(cmd.type), id(cmd.id), buf(cmd.buf), res(cmd.res) {
+    cmd_tp(cmd.cmd_tp), type(cmd.type), id(cmd.id), off(cmd.off), len(cmd.len),
+    buf(cmd.buf), res(cmd.res) {
     // Lab3: Your code here
 }
 chfs_command_raft::~chfs_command_raft() {
@@ -18,12 +22,12 @@ chfs_command_raft::~chfs_command_raft() {
 
 int chfs_command_raft::size() const{ 
     // Lab3: Your code here
-    return buf.size() + 16;
+    return buf.size() + 24;
 }
 
 void chfs_command_raft::serialize(char *buf_out, int size) const {
     // Lab3: Your code here
-    if (size != 16 + buf.size()) {
+    if (size != 24 + buf.size()) {
         printf("chfs_command_raft serialize failed!\n");
         return;
     }
@@ -31,7 +35,9 @@ void chfs_command_raft::serialize(char *buf_out, int size) const {
     memcpy(buf_out, &cmd_tp_int, sizeof(int));
     memcpy(buf_out + 4, &type, sizeof(uint32_t));
     memcpy(buf_out + 8, &id, sizeof(extent_protocol::extentid_t));
-    memcpy(buf_out + 16, buf.c_str(), buf.size());
+    memcpy(buf_out + 16, &off, sizeof(uint32_t));
+    memcpy(buf_out + 20, &len, sizeof(uint32_t));
+    memcpy(buf_out + 24, buf.c_str(), buf.size());
     return;
 }
 
@@ -41,8 +47,10 @@ void chfs_command_raft::deserialize(const char *buf_in, int size) {
     memcpy(&cmd_tp_int, buf_in, sizeof(int));
     memcpy(&type, buf_in + 4, sizeof(uint32_t));
     memcpy(&id, buf_in + 8, sizeof(extent_protocol::extentid_t));
-    buf.resize(size - 16);
-    memcpy(&buf[0], buf_in + 16, size - 16);
+    memcpy(&off, buf_in + 16, sizeof(uint32_t));
+    memcpy(&len, buf_in + 20, sizeof(uint32_t));
+    buf.resize(size - 24);
+    memcpy(&buf[0], buf_in + 24, size - 24);
     cmd_tp = (command_type) cmd_tp_int;
     return;
 }
@@ -52,6 +60,8 @@ marshall &operator<<(marshall &m, const chfs_command_raft &cmd) {
     m << (int) cmd.cmd_tp;
     m << cmd.type;
     m << cmd.id;
+    m << cmd.off;
+    m << cmd.len;
     m << cmd.buf;
     return m;
 }
@@ -63,6 +73,8 @@ unmarshall &operator>>(unmarshall &u, chfs_command_raft &cmd) {
     cmd.cmd_tp = (chfs_command_raft::command_type) cmd_tp_int;
     u >> cmd.type;
     u >> cmd.id;
+    u >> cmd.off;
+    u >> cmd.len;
     u >> cmd.buf;
     return u;
 }
@@ -71,6 +83,8 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
     chfs_command_raft &chfs_cmd = dynamic_cast<chfs_command_raft &>(cmd);
     // Lab3: Your code here
     std::unique_lock<std::mutex> lock(mtx);
+    // Leases are enforced by extent_server_dist before a change is logged,
+    // so changes are applied here as client 0, which holds no leases.
     switch (chfs_cmd.cmd_tp) {
         case chfs_command_raft::CMD_CRT: {
             // printf("apply_log: create, type: %d\n", chfs_cmd.type);
@@ -80,7 +94,7 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
         case chfs_command_raft::CMD_PUT: {
             int tmp;
             // printf("apply_log: put, inum: %d, buf: %s\n", chfs_cmd.id, chfs_cmd.buf.c_str());
-            es.put(chfs_cmd.id, chfs_cmd.buf, tmp);
+            chfs_cmd.res->ret = es.put(chfs_cmd.id, chfs_cmd.buf, 0, tmp);
             break;
         }
         case chfs_command_raft::CMD_GET: {
@@ -96,7 +110,42 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
         case chfs_command_raft::CMD_RMV: {
             int tmp;
             // printf("apply_log: remove, inum: %d\n", chfs_cmd.id);
-            es.remove(chfs_cmd.id, tmp);
+            es.remove(chfs_cmd.id, 0, tmp);
+            break;
+        }
+        case chfs_command_raft::CMD_READ: {
+            es.read(chfs_cmd.id, chfs_cmd.off, chfs_cmd.len, chfs_cmd.res->buf);
+            break;
+        }
+        case chfs_command_raft::CMD_WRITE: {
+            int tmp;
+            chfs_cmd.res->ret = es.write(chfs_cmd.id, chfs_cmd.off, chfs_cmd.buf, 0, tmp);
+            break;
+        }
+        case chfs_command_raft::CMD_TRUNC: {
+            int tmp;
+            chfs_cmd.res->ret = es.truncate(chfs_cmd.id, chfs_cmd.len, 0, tmp);
+            break;
+        }
+        case chfs_command_raft::CMD_COMPOUND: {
+            std::vector<extent_protocol::op> ops;
+            unmarshall u(chfs_cmd.buf);
+            u >> ops;
+            chfs_cmd.res->ret = es.compound(ops, 0, chfs_cmd.res->id);
+            break;
+        }
+        case chfs_command_raft::CMD_GETA_MANY: {
+            std::vector<extent_protocol::extentid_t> ids;
+            std::vector<extent_protocol::attr> attrs;
+            unmarshall u(chfs_cmd.buf);
+            u >> ids;
+            attrs.resize(ids.size());
+            for (size_t i = 0; i < ids.size(); i++) {
+                es.getattr(ids[i], attrs[i]);
+            }
+            marshall m;
+            m << attrs;
+            chfs_cmd.res->buf = m.str();
             break;
         }
     }
@@ -11,6 +11,11 @@ public:
         CMD_GET,  // Get a file
         CMD_GETA, // Get a file's attributes
         CMD_RMV,  // Remove a file   
+        CMD_READ, // Read a byte range of a file
+        CMD_WRITE,// Write a byte range of a file
+        CMD_TRUNC,// Set the size of a file to len
+        CMD_COMPOUND,// Run the marshalled extent_protocol::op steps in buf
+        CMD_GETA_MANY,// Get the attributes of the marshalled ids in buf
     };
 
     struct result {
@@ -19,6 +24,7 @@ public:
         std::string buf;
         extent_protocol::attr attr;
         command_type tp;
+        int ret;                    // what the extent_server call returned
 
         bool done;
         std::mutex mtx;             // protect the struct
@@ -29,6 +35,8 @@ public:
     command_type cmd_tp;
     uint32_t type;
     extent_protocol::extentid_t id;
+    uint32_t off;
+    uint32_t len;
     std::string buf;
     std::shared_ptr<result> res;
 
@@ -6,14 +6,233 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <future>
 
-extent_client::extent_client(std::string dst) {
+extent_client::extent_client(std::string dst, bool writeback)
+    : writeback(writeback), stopping(false), dirty_bytes(0) {
     sockaddr_in dstsock;
     make_sockaddr(dst.c_str(), &dstsock);
     cl = new rpcc(dstsock);
     if (cl->bind() != 0) {
         printf("extent_client: bind failed\n");
     }
+    id = cl->id();
+    if (writeback) {
+        flusher = std::thread(&extent_client::flusher_loop, this);
+    }
+}
+
+extent_client::~extent_client() {
+    if (writeback) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake_flusher.notify_all();
+        flusher.join();
+        flush();
+    }
+}
+
+// The cache entry for eid if its lease has not run out yet, else NULL.
+// Called with mtx held.
+extent_client::cached_extent *
+extent_client::cached(extent_protocol::extentid_t eid) {
+    auto it = cache.find(eid);
+    if (it == cache.end()) {
+        return NULL;
+    }
+    if (it->second.expire <= clock::now()) {
+        cache.erase(it);
+        return NULL;
+    }
+    return &it->second;
+}
+
+bool
+extent_client::cacheable(const extent_protocol::attr &a) {
+    return a.size <= (a.type == extent_protocol::T_DIR ? MAX_CACHED_DIR : MAX_CACHED_FILE);
+}
+
+// Account in a for writes to eid that are still buffered.
+// Called with mtx held.
+void
+extent_client::dirty_attr(extent_protocol::extentid_t eid,
+                          extent_protocol::attr &a) {
+    auto it = dirty.find(eid);
+    if (it == dirty.end()) {
+        return;
+    }
+    const auto &last = *it->second.runs.rbegin();
+    a.size = std::max<uint32_t>(a.size, last.first + last.second.size());
+    a.mtime = a.ctime = it->second.mtime;
+}
+
+// The cache entry for eid after we changed it, with its times moved on
+// the way the server moves them, or NULL if eid is not cached.
+// Called with mtx held.
+extent_client::cached_extent *
+extent_client::touch(extent_protocol::extentid_t eid) {
+    cached_extent *c = cached(eid);
+    if (c) {
+        c->attr.mtime = c->attr.ctime = time(0);
+    }
+    return c;
+}
+
+// Wait until no flush of eid is in flight.  Called with mtx held.
+void
+extent_client::settle(extent_protocol::extentid_t eid,
+                      std::unique_lock<std::mutex> &lock) {
+    while (flushing.count(eid)) {
+        flushed.wait(lock);
+    }
+}
+
+// Drop the buffered writes to eid; it is being replaced or removed.
+void
+extent_client::discard(extent_protocol::extentid_t eid) {
+    std::unique_lock<std::mutex> lock(mtx);
+    settle(eid, lock);
+    auto it = dirty.find(eid);
+    if (it != dirty.end()) {
+        dirty_bytes -= it->second.bytes;
+        dirty.erase(it);
+    }
+    flush_errors.erase(eid);
+}
+
+// Flushes extents whose oldest buffered write is WB_DELAY_MS old.
+void
+extent_client::flusher_loop() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping) {
+        wake_flusher.wait_for(lock, std::chrono::milliseconds(WB_DELAY_MS / 2));
+        clock::time_point old = clock::now() - std::chrono::milliseconds(WB_DELAY_MS);
+        std::vector<extent_protocol::extentid_t> due;
+        for (auto &d : dirty) {
+            if (d.second.since <= old) {
+                due.push_back(d.first);
+            }
+        }
+        lock.unlock();
+        for (extent_protocol::extentid_t eid : due) {
+            extent_protocol::status r = flush(eid);
+            if (r != extent_protocol::OK) {
+                std::lock_guard<std::mutex> elock(mtx);
+                flush_errors.emplace(eid, r);
+            }
+        }
+        lock.lock();
+    }
+}
+
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    std::unique_lock<std::mutex> lock(mtx);
+    settle(eid, lock);
+    auto e = flush_errors.find(eid);
+    if (e != flush_errors.end()) {
+        ret = e->second;
+        flush_errors.erase(e);
+    }
+    auto it = dirty.find(eid);
+    if (it == dirty.end()) {
+        return ret;
+    }
+    std::map<uint32_t, std::string> runs;
+    runs.swap(it->second.runs);
+    dirty_bytes -= it->second.bytes;
+    dirty.erase(it);
+    // Writes buffered from here on wait for this flush to finish before
+    // they are flushed themselves, so runs reach the server in order.
+    flushing.insert(eid);
+    lock.unlock();
+    // Report the first run that failed, not just the last one
+    for (auto &r : runs) {
+        extent_protocol::status rr = write_through(eid, r.first, std::move(r.second));
+        if (rr != extent_protocol::OK && ret == extent_protocol::OK) {
+            ret = rr;
+        }
+    }
+    lock.lock();
+    flushing.erase(eid);
+    flushed.notify_all();
+    return ret;
+}
+
+extent_protocol::status
+extent_client::flush() {
+    std::vector<extent_protocol::extentid_t> eids;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &d : dirty) {
+            eids.push_back(d.first);
+        }
+    }
+    extent_protocol::status ret = extent_protocol::OK;
+    for (extent_protocol::extentid_t eid : eids) {
+        extent_protocol::status r = flush(eid);
+        if (r != extent_protocol::OK && ret == extent_protocol::OK) {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+// Bring the cached copy of eid in line with a change we made to it.
+// Called with mtx held.
+void
+extent_client::cached_put(extent_protocol::extentid_t eid, const std::string &buf) {
+    cached_extent *c = touch(eid);
+    if (c) {
+        c->attr.size = buf.size();
+        c->has_data = cacheable(c->attr);
+        if (c->has_data) {
+            c->data = buf;
+        } else {
+            c->data.clear();
+        }
+    }
+}
+
+void
+extent_client::cached_write(extent_protocol::extentid_t eid, uint32_t off,
+                            const std::string &buf) {
+    cached_extent *c = touch(eid);
+    if (c) {
+        if (off + buf.size() > c->attr.size) {
+            c->attr.size = off + buf.size();
+        }
+        if (c->has_data && cacheable(c->attr)) {
+            if (c->data.size() < c->attr.size) {
+                c->data.resize(c->attr.size, '\0');
+            }
+            c->data.replace(off, buf.size(), buf);
+        } else {
+            c->has_data = false;
+            c->data.clear();
+        }
+    }
+}
+
+void
+extent_client::cached_truncate(extent_protocol::extentid_t eid, uint32_t size) {
+    cached_extent *c = touch(eid);
+    if (c) {
+        c->attr.size = size;
+        if (c->has_data && cacheable(c->attr)) {
+            c->data.resize(size, '\0');
+        } else {
+            c->has_data = false;
+            c->data.clear();
+        }
+    }
 }
 
 extent_protocol::status
@@ -27,8 +246,31 @@ extent_client::create(uint32_t type,  extent_protocol::extentid_t &id) {
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::get, eid, buf);
+    extent_protocol::attr a;
+    flush(eid);
+    getattr(eid, a);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        cached_extent *c = cached(eid);
+        if (c && c->has_data) {
+            buf = c->data;
+            return ret;
+        }
+    }
+    if (a.size > RPC_CHUNK) {
+        ret = read_chunks(eid, 0, a.size, buf);
+    } else {
+        ret = cl->call(extent_protocol::get, eid, buf);
+    }
     VERIFY(ret == extent_protocol::OK);
+    // Only keep the contents if the lease outlived the call, so nobody
+    // else can have changed them since they were read.
+    std::lock_guard<std::mutex> lock(mtx);
+    cached_extent *c = cached(eid);
+    if (c && cacheable(c->attr)) {
+        c->data = buf;
+        c->has_data = true;
+    }
     return ret;
 }
 
@@ -36,8 +278,80 @@ extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid,
                        extent_protocol::attr &attr) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        settle(eid, lock);
+        cached_extent *c = cached(eid);
+        if (c) {
+            attr = c->attr;
+            dirty_attr(eid, attr);
+            return ret;
+        }
+    }
+    // The lease runs from when the server granted it; counting from
+    // before the call keeps our idea of it on the safe side.
+    clock::time_point start = clock::now();
+    extent_protocol::leased_attr l;
+    ret = cl->call(extent_protocol::getattr_lease, eid, id, l);
+    VERIFY(ret == extent_protocol::OK);
+    attr = l.a;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (l.lease > 0) {
+        cached_extent &c = cache[eid];
+        c.expire = start + std::chrono::milliseconds(l.lease);
+        c.attr = l.a;
+        c.has_data = false;
+        c.data.clear();
+    }
+    dirty_attr(eid, attr);
+    return ret;
+}
+
+// getattr for each of eids; the ones not cached are fetched, and
+// leased, with a single RPC.
+extent_protocol::status
+extent_client::getattr_many(const std::vector<extent_protocol::extentid_t> &eids,
+                            std::vector<extent_protocol::attr> &attrs) {
+    extent_protocol::status ret = extent_protocol::OK;
+    std::vector<extent_protocol::extentid_t> missing;
+    std::vector<size_t> where;
+    attrs.resize(eids.size());
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (size_t i = 0; i < eids.size(); i++) {
+            settle(eids[i], lock);
+            cached_extent *c = cached(eids[i]);
+            if (c) {
+                attrs[i] = c->attr;
+                dirty_attr(eids[i], attrs[i]);
+            } else {
+                missing.push_back(eids[i]);
+                where.push_back(i);
+            }
+        }
+    }
+    if (missing.empty()) {
+        return ret;
+    }
+
+    clock::time_point start = clock::now();
+    std::vector<extent_protocol::leased_attr> l;
+    ret = cl->call(extent_protocol::getattr_many, missing, id, l);
     VERIFY(ret == extent_protocol::OK);
+    VERIFY(l.size() == missing.size());
+    std::lock_guard<std::mutex> lock(mtx);
+    for (size_t j = 0; j < missing.size(); j++) {
+        extent_protocol::attr &attr = attrs[where[j]];
+        attr = l[j].a;
+        if (l[j].lease > 0) {
+            cached_extent &c = cache[missing[j]];
+            c.expire = start + std::chrono::milliseconds(l[j].lease);
+            c.attr = l[j].a;
+            c.has_data = false;
+            c.data.clear();
+        }
+        dirty_attr(missing[j], attr);
+    }
     return ret;
 }
 
@@ -45,8 +359,29 @@ extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf) {
     int r;
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::put, eid, buf,  r);
-    VERIFY(ret == extent_protocol::OK);
+    discard(eid);
+    // The RPC layer may hold on to the data after the call returns (for
+    // a retransmission), so it is never modified once it has been sent.
+    std::shared_ptr<const std::string> data =
+        std::make_shared<const std::string>(std::move(buf));
+    rpc_bytes b(data);
+    if (b.len <= RPC_PUT_MAX) {
+        ret = cl->call(extent_protocol::put, eid, b, id, r);
+    } else {
+        // Too big for one message: replace the contents with the first
+        // chunk, then add the rest.  See RPC_PUT_MAX.
+        ret = cl->call(extent_protocol::put, eid, b.slice(0, RPC_CHUNK), id, r);
+        if (ret == extent_protocol::OK) {
+            ret = write_chunks(eid, RPC_CHUNK, b.slice(RPC_CHUNK, b.len));
+        }
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    if (ret != extent_protocol::OK) {
+        // The server may hold none, or only part, of the new contents
+        cache.erase(eid);
+        return ret;
+    }
+    cached_put(eid, *data);
     return ret;
 }
 
@@ -54,7 +389,253 @@ extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid) {
     int r = 0;
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::remove, eid, r);
+    discard(eid);
+    ret = cl->call(extent_protocol::remove, eid, id, r);
+    VERIFY(ret == extent_protocol::OK);
+    std::lock_guard<std::mutex> lock(mtx);
+    cache.erase(eid);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, uint32_t off,
+                    uint32_t len, std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    extent_protocol::attr a;
+    flush(eid);
+    getattr(eid, a);
+    bool whole = false;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        cached_extent *c = cached(eid);
+        if (c && c->has_data) {
+            buf = off < c->data.size() ? c->data.substr(off, len) : "";
+            return ret;
+        }
+        whole = c && cacheable(c->attr);
+    }
+    // Small extents are fetched whole, so later reads are served locally.
+    if (whole) {
+        std::string data;
+        get(eid, data);
+        buf = off < data.size() ? data.substr(off, len) : "";
+        return ret;
+    }
+    ret = read_chunks(eid, off, len, buf);
     VERIFY(ret == extent_protocol::OK);
     return ret;
 }
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, uint32_t off,
+                     std::string buf) {
+    flush(eid);
+    return write_through(eid, off, buf);
+}
+
+extent_protocol::status
+extent_client::write_buffered(extent_protocol::extentid_t eid, uint32_t off,
+                              const std::string &buf) {
+    if (!writeback) {
+        return write(eid, off, buf);
+    }
+    if (buf.empty()) {
+        return extent_protocol::OK;
+    }
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto ins = dirty.emplace(eid, dirty_extent());
+        dirty_extent &d = ins.first->second;
+        if (ins.second) {
+            d.since = clock::now();
+        }
+        d.mtime = time(0);
+        dirty_bytes -= d.bytes;
+
+        // Merge [off, end) with every run it overlaps or touches.
+        uint32_t end = off + buf.size();
+        auto first = d.runs.upper_bound(off);
+        if (first != d.runs.begin()) {
+            auto prev = std::prev(first);
+            if (prev->first + prev->second.size() >= off) {
+                first = prev;
+            }
+        }
+        uint32_t start = off, stop = end;
+        auto last = first;
+        for (; last != d.runs.end() && last->first <= end; ++last) {
+            start = std::min(start, last->first);
+            stop = std::max<uint32_t>(stop, last->first + last->second.size());
+        }
+        if (first != last && first->first == start) {
+            // Grow the first run in place, so appends stay linear.
+            std::string &run = first->second;
+            d.bytes -= run.size();
+            run.resize(stop - start, '\0');
+            for (auto it = std::next(first); it != last; ++it) {
+                run.replace(it->first - start, it->second.size(), it->second);
+                d.bytes -= it->second.size();
+            }
+            run.replace(off - start, buf.size(), buf);
+            d.bytes += run.size();
+            d.runs.erase(std::next(first), last);
+        } else {
+            std::string run(stop - start, '\0');
+            for (auto it = first; it != last; ++it) {
+                run.replace(it->first - start, it->second.size(), it->second);
+                d.bytes -= it->second.size();
+            }
+            run.replace(off - start, buf.size(), buf);
+            d.bytes += run.size();
+            d.runs.erase(first, last);
+            d.runs[start].swap(run);
+        }
+
+        dirty_bytes += d.bytes;
+        full = dirty_bytes > WB_MAX_BYTES;
+    }
+    return full ? flush() : extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::write_through(extent_protocol::extentid_t eid, uint32_t off,
+                             std::string buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    std::shared_ptr<const std::string> data =
+        std::make_shared<const std::string>(std::move(buf));
+    ret = write_chunks(eid, off, rpc_bytes(data));
+    std::lock_guard<std::mutex> lock(mtx);
+    if (ret != extent_protocol::OK) {
+        // Part of the range may have been written before the disk filled
+        cache.erase(eid);
+        return ret;
+    }
+    cached_write(eid, off, *data);
+    return ret;
+}
+
+// Start the async RPCs fn(0) .. fn(n - 1) from this thread, keeping at
+// most RPC_WINDOW of them outstanding, and wait for all of them.
+extent_protocol::status
+extent_client::pipeline(size_t n,
+                        const std::function<std::future<int>(size_t)> &fn) {
+    extent_protocol::status ret = extent_protocol::OK;
+    std::deque<std::future<int> > inflight;
+    for (size_t i = 0; i < n || !inflight.empty(); ) {
+        if (i < n && inflight.size() < RPC_WINDOW) {
+            inflight.push_back(fn(i++));
+            continue;
+        }
+        extent_protocol::status r = (extent_protocol::status) inflight.front().get();
+        inflight.pop_front();
+        if (r != extent_protocol::OK) {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+extent_protocol::status
+extent_client::read_chunks(extent_protocol::extentid_t eid, uint32_t off,
+                           uint32_t len, std::string &buf) {
+    // The chunk offsets below must not wrap around
+    len = std::min(len, UINT32_MAX - off);
+    if (len <= RPC_CHUNK) {
+        return cl->call(extent_protocol::read, eid, off, len, buf);
+    }
+    size_t n = (len + RPC_CHUNK - 1) / RPC_CHUNK;
+    std::vector<std::string> parts(n);
+    extent_protocol::status ret = pipeline(n, [&](size_t i) {
+        uint32_t o = i * RPC_CHUNK;
+        return cl->async_call(extent_protocol::read, &parts[i], eid, off + o,
+                              std::min<uint32_t>(RPC_CHUNK, len - o));
+    });
+    buf.clear();
+    buf.reserve(len);
+    for (size_t i = 0; i < n; i++) {
+        buf += parts[i];
+        // A short piece is the end of the file
+        if (parts[i].size() < RPC_CHUNK) {
+            break;
+        }
+    }
+    return ret;
+}
+
+extent_protocol::status
+extent_client::write_chunks(extent_protocol::extentid_t eid, uint32_t off,
+                            const rpc_bytes &buf) {
+    if (buf.len > UINT32_MAX - off) {
+        return extent_protocol::IOERR;
+    }
+    if (buf.len <= RPC_CHUNK) {
+        int r;
+        return cl->call(extent_protocol::write, eid, off, buf, id, r);
+    }
+    size_t n = (buf.len + RPC_CHUNK - 1) / RPC_CHUNK;
+    std::vector<int> r(n);
+    return pipeline(n, [&](size_t i) {
+        uint32_t o = i * RPC_CHUNK;
+        return cl->async_call(extent_protocol::write, &r[i], eid, off + o,
+                              buf.slice(o, RPC_CHUNK), id);
+    });
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, uint32_t size) {
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    flush(eid);
+    ret = cl->call(extent_protocol::truncate, eid, size, id, r);
+    if (ret != extent_protocol::OK) {
+        return ret;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    cached_truncate(eid, size);
+    return ret;
+}
+
+// Run ops on the server as one atomic change (see extent_protocol::op)
+// and return the id of the extent the last create step made.
+extent_protocol::status
+extent_client::compound(std::vector<extent_protocol::op> ops,
+                        extent_protocol::extentid_t &created) {
+    extent_protocol::status ret = extent_protocol::OK;
+    for (const extent_protocol::op &o : ops) {
+        if (o.proc == extent_protocol::create || o.id == 0) {
+            continue;
+        }
+        if (o.proc == extent_protocol::put || o.proc == extent_protocol::remove) {
+            discard(o.id);
+        } else {
+            flush(o.id);
+        }
+    }
+    ret = cl->call(extent_protocol::compound, ops, id, created);
+    if (ret != extent_protocol::OK) {
+        return ret;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    for (extent_protocol::op &o : ops) {
+        extent_protocol::extentid_t eid = o.id ? o.id : created;
+        if (o.patch >= 0) {
+            memcpy(&o.buf[o.patch], &created, sizeof(created));
+        }
+        switch (o.proc) {
+        case extent_protocol::put:
+            cached_put(eid, o.buf);
+            break;
+        case extent_protocol::write:
+            cached_write(eid, o.arg, o.buf);
+            break;
+        case extent_protocol::truncate:
+            cached_truncate(eid, o.arg);
+            break;
+        case extent_protocol::remove:
+            cache.erase(eid);
+            break;
+        }
+    }
+    return ret;
+}
@@ -3,25 +3,134 @@
 #ifndef extent_client_h
 #define extent_client_h
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Largest contents cached whole for a directory and for other extents.
+#define MAX_CACHED_DIR  (4*1024*1024)
+#define MAX_CACHED_FILE (64*1024)
+
+// Reads and writes bigger than RPC_CHUNK are split into RPC_CHUNK
+// pieces, RPC_WINDOW of which are kept in flight at once; this also
+// keeps every message well under the RPC layer's MAX_PDU.  Written data
+// is shared with the RPC layer rather than copied into each chunk.
+#define RPC_CHUNK  (256*1024)
+#define RPC_WINDOW 8
+
+// A put up to RPC_PUT_MAX goes in one RPC, so it replaces the contents
+// in a single change.  A bigger one cannot fit in a message: it is sent
+// as a put of the first RPC_CHUNK followed by chunked writes, and is not
+// atomic -- other clients, or the disk after a crash, may see the file
+// cut short at any chunk boundary.
+#define RPC_PUT_MAX (8*1024*1024)
+
+// Write-back mode: dirty bytes buffered before writers flush everything,
+// and how long dirty data may wait before the flusher thread sends it.
+#define WB_MAX_BYTES (4*1024*1024)
+#define WB_DELAY_MS  1000
+
+// Attributes, and the whole contents of small extents, are cached for as
+// long as the read lease the server granted with them (getattr_lease).
+// Our own changes update the cache in place; changes by other clients
+// wait at the server until our lease has run out.
+//
+// In write-back mode write_buffered() only records the bytes; adjacent
+// and overlapping writes are merged into runs, each sent as one write
+// RPC when the extent is flushed: by flush() (fsync and close), before
+// any other operation on the extent, when WB_MAX_BYTES are dirty, or by
+// the flusher thread once the data is WB_DELAY_MS old.  Other clients
+// see buffered data only after it has been flushed.
 class extent_client {
 private:
+    typedef std::chrono::steady_clock clock;
+    struct cached_extent {
+        clock::time_point expire;
+        extent_protocol::attr attr;
+        bool has_data;
+        std::string data;
+    };
+    // Dirty runs of an extent by offset, disjoint and not adjacent.
+    struct dirty_extent {
+        std::map<uint32_t, std::string> runs;
+        size_t bytes;
+        clock::time_point since;
+        unsigned int mtime;
+        dirty_extent() : bytes(0), mtime(0) {}
+    };
+
     rpcc *cl;
+    unsigned int id;
+    std::mutex mtx;
+    std::map<extent_protocol::extentid_t, cached_extent> cache;
+
+    cached_extent *cached(extent_protocol::extentid_t eid);
+    bool cacheable(const extent_protocol::attr &a);
+    cached_extent *touch(extent_protocol::extentid_t eid);
+    void dirty_attr(extent_protocol::extentid_t eid, extent_protocol::attr &a);
+    void cached_put(extent_protocol::extentid_t eid, const std::string &buf);
+    void cached_write(extent_protocol::extentid_t eid, uint32_t off,
+                      const std::string &buf);
+    void cached_truncate(extent_protocol::extentid_t eid, uint32_t size);
+
+    bool writeback;
+    bool stopping;
+    size_t dirty_bytes;
+    std::map<extent_protocol::extentid_t, dirty_extent> dirty;
+    std::set<extent_protocol::extentid_t> flushing;
+    // Errors of background flushes, reported by the next flush(eid)
+    std::map<extent_protocol::extentid_t, extent_protocol::status> flush_errors;
+    std::condition_variable flushed;
+    std::condition_variable wake_flusher;
+    std::thread flusher;
+
+    void settle(extent_protocol::extentid_t eid, std::unique_lock<std::mutex> &lock);
+    void discard(extent_protocol::extentid_t eid);
+    void flusher_loop();
+    extent_protocol::status write_through(extent_protocol::extentid_t eid,
+                                          uint32_t off, std::string buf);
+    extent_protocol::status pipeline(size_t n,
+                                     const std::function<std::future<int>(size_t)> &fn);
+    extent_protocol::status read_chunks(extent_protocol::extentid_t eid, uint32_t off,
+                                        uint32_t len, std::string &buf);
+    extent_protocol::status write_chunks(extent_protocol::extentid_t eid, uint32_t off,
+                                         const rpc_bytes &buf);
 
 public:
-    extent_client(std::string dst);
+    extent_client(std::string dst, bool writeback = false);
+    ~extent_client();
 
     extent_protocol::status create(uint32_t type,  extent_protocol::extentid_t &eid);
     extent_protocol::status get(extent_protocol::extentid_t eid,
                                 std::string &buf);
     extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                     extent_protocol::attr &a);
+    extent_protocol::status getattr_many(const std::vector<extent_protocol::extentid_t> &eids,
+                                         std::vector<extent_protocol::attr> &attrs);
     extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
+    extent_protocol::status read(extent_protocol::extentid_t eid, uint32_t off,
+                                 uint32_t len, std::string &buf);
+    extent_protocol::status write(extent_protocol::extentid_t eid, uint32_t off,
+                                  std::string buf);
+    extent_protocol::status write_buffered(extent_protocol::extentid_t eid,
+                                           uint32_t off, const std::string &buf);
+    extent_protocol::status flush(extent_protocol::extentid_t eid);
+    extent_protocol::status flush();
+    extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                     uint32_t size);
+    extent_protocol::status compound(std::vector<extent_protocol::op> ops,
+                                     extent_protocol::extentid_t &created);
 
 };
 
@@ -0,0 +1,88 @@
+// read leases handed out by the extent servers
+
+#ifndef extent_lease_h
+#define extent_lease_h
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "extent_protocol.h"
+
+// While a client holds an unexpired lease on an extent it may answer
+// getattr, get and read for that extent from its own cache.  In return a
+// change to the extent by any other client is held back until the lease
+// has run out, and no new leases are granted while a change is waiting,
+// so a busy reader cannot starve writers.  Client id 0 is used for
+// changes that do not come from a caching client.
+class lease_table {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  lease_table(unsigned int ms = extent_protocol::LEASE_MS) : ms(ms) {}
+
+  // Lease id to clt; returns its length in ms, or 0 if none was granted.
+  unsigned int grant(unsigned int clt, extent_protocol::extentid_t id);
+  // Wait until no client but clt holds a lease on id.  Must be paired
+  // with end_change() once the change has been applied.
+  void begin_change(unsigned int clt, extent_protocol::extentid_t id);
+  void end_change(extent_protocol::extentid_t id);
+
+ private:
+  struct extent_leases {
+    std::map<unsigned int, clock::time_point> holders;
+    int changes;
+    extent_leases() : changes(0) {}
+  };
+  unsigned int ms;
+  std::mutex mtx;
+  std::map<extent_protocol::extentid_t, extent_leases> leases;
+};
+
+inline unsigned int
+lease_table::grant(unsigned int clt, extent_protocol::extentid_t id)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  extent_leases &l = leases[id];
+  if (l.changes > 0)
+    return 0;
+  l.holders[clt] = clock::now() + std::chrono::milliseconds(ms);
+  return ms;
+}
+
+inline void
+lease_table::begin_change(unsigned int clt, extent_protocol::extentid_t id)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  extent_leases &l = leases[id];
+  l.changes++;
+  for (;;) {
+    clock::time_point now = clock::now(), until = now;
+    for (auto it = l.holders.begin(); it != l.holders.end(); ) {
+      if (it->second <= now) {
+        it = l.holders.erase(it);
+        continue;
+      }
+      if (it->first != clt)
+        until = std::max(until, it->second);
+      ++it;
+    }
+    if (until == now)
+      return;
+    lock.unlock();
+    std::this_thread::sleep_until(until);
+    lock.lock();
+  }
+}
+
+inline void
+lease_table::end_change(extent_protocol::extentid_t id)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = leases.find(id);
+  if (--it->second.changes == 0 && it->second.holders.empty())
+    leases.erase(it);
+}
+
+#endif
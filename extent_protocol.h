@@ -15,9 +15,18 @@ class extent_protocol {
     get,
     getattr,
     remove,
-    create
+    create,
+    read,
+    write,
+    truncate,
+    getattr_lease,
+    compound,
+    getattr_many
   };
 
+  // Length of the read leases granted by getattr_lease, in ms.
+  enum { LEASE_MS = 500 };
+
   //add the new file type symlink.
   enum types {
     T_DIR = 1,
@@ -33,6 +42,32 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // Reply of getattr_lease, and per extent of getattr_many: the
+  // attributes, and for how many ms the caller may cache the extent
+  // (0 if no lease was granted).
+  struct leased_attr {
+    attr a;
+    unsigned int lease;
+  };
+
+  // One step of a compound call.  proc is create, put, write, truncate
+  // or remove; arg is the type for create, the offset for write and the
+  // size for truncate.  An id of 0 names the extent made by the latest
+  // create step, and if patch >= 0 that extent's id is first stored at
+  // buf[patch] in host byte order, so that a new directory entry can
+  // point at an inode that does not exist yet.
+  struct op {
+    uint32_t proc;
+    extentid_t id;
+    uint32_t arg;
+    int patch;
+    std::string buf;
+    op() : proc(0), id(0), arg(0), patch(-1) {}
+    op(uint32_t proc, extentid_t id, uint32_t arg = 0,
+       const std::string &buf = "", int patch = -1)
+      : proc(proc), id(id), arg(arg), patch(patch), buf(buf) {}
+  };
 };
 
 inline unmarshall &
@@ -57,4 +92,42 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::leased_attr &l)
+{
+  u >> l.a;
+  u >> l.lease;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::leased_attr l)
+{
+  m << l.a;
+  m << l.lease;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::op &o)
+{
+  u >> o.proc;
+  u >> o.id;
+  u >> o.arg;
+  u >> o.patch;
+  u >> o.buf;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::op &o)
+{
+  m << o.proc;
+  m << o.id;
+  m << o.arg;
+  m << o.patch;
+  m << o.buf;
+  return m;
+}
+
 #endif 
@@ -8,30 +8,44 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <set>
+#include <algorithm>
 
-extent_server::extent_server() 
+extent_server::extent_server(const char *image, uint64_t disk_size,
+                             uint32_t block_size, uint32_t ninodes)
 {
-  im = new inode_manager();
+  im = new inode_manager(image, disk_size, block_size, ninodes);
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
   printf("extent_server: create inode\n");
+  std::lock_guard<std::mutex> lock(mtx);
   id = im->alloc_inode(type);
+  im->flush();
 
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::put(extent_protocol::extentid_t id, std::string_view buf,
+                       unsigned int clt, int &)
 {
   id &= 0x7fffffff;
   
-  const char * cbuf = buf.c_str();
+  const char * cbuf = buf.data();
   int size = buf.size();
-  im->write_file(id, cbuf, size);
+  leases.begin_change(clt, id);
+  int r = extent_protocol::OK;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (im->write_file(id, cbuf, size) < 0)
+      r = extent_protocol::IOERR;
+    im->flush();
+  }
+  leases.end_change(id);
   
-  return extent_protocol::OK;
+  return r;
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
@@ -40,20 +54,63 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 
   id &= 0x7fffffff;
 
-  int size = 0;
-  char *cbuf = NULL;
+  extent_protocol::attr attr;
+  std::lock_guard<std::mutex> lock(mtx);
+  im->get_attr(id, attr);
+  buf.resize(attr.size);
+  if (attr.size != 0)
+    buf.resize(im->read_range(id, 0, attr.size, &buf[0]));
 
-  im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    buf = "";
-  else {
-    buf.assign(cbuf, size);
-    free(cbuf);
-  }
+  return extent_protocol::OK;
+}
+
+/* Same as get, but the contents are only read out of the inode layer
+ * when the reply is marshalled, see operator<< below. */
+int extent_server::get_contents(extent_protocol::extentid_t id, extent_contents &c)
+{
+  printf("extent_server: get %lld\n", id);
+
+  c.im = im;
+  c.mtx = &mtx;
+  c.inum = id & 0x7fffffff;
+  c.off = 0;
+  c.len = UINT32_MAX;
+
+  return extent_protocol::OK;
+}
+
+/* Same as read, but like get_contents the bytes are only read out of
+ * the inode layer when the reply is marshalled. */
+int extent_server::read_contents(extent_protocol::extentid_t id, uint32_t off,
+                                 uint32_t len, extent_contents &c)
+{
+  printf("extent_server: read %lld off %u len %u\n", id, off, len);
+
+  c.im = im;
+  c.mtx = &mtx;
+  c.inum = id & 0x7fffffff;
+  c.off = off;
+  c.len = len;
 
   return extent_protocol::OK;
 }
 
+marshall &
+operator<<(marshall &m, const extent_contents &c)
+{
+  extent_protocol::attr attr;
+  std::lock_guard<std::mutex> lock(*c.mtx);
+  c.im->get_attr(c.inum, attr);
+  uint32_t len = 0;
+  if (c.off < attr.size)
+    len = std::min(c.len, attr.size - c.off);
+  m << (unsigned int) len;
+  char *p = m.reserve(len);
+  uint32_t n = len ? c.im->read_range(c.inum, c.off, len, p) : 0;
+  memset(p + n, 0, len - n);
+  return m;
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
   printf("extent_server: getattr %lld\n", id);
@@ -62,19 +119,237 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
+  std::lock_guard<std::mutex> lock(mtx);
   im->get_attr(id, attr);
   a = attr;
 
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+/* getattr, plus a read lease on the extent for the calling client. */
+int extent_server::getattr_lease(extent_protocol::extentid_t id, unsigned int clt,
+                                 extent_protocol::leased_attr &l)
+{
+  id &= 0x7fffffff;
+  l.lease = leases.grant(clt, id);
+  return getattr(id, l.a);
+}
+
+/* getattr_lease for each of ids, in one call. */
+int extent_server::getattr_many(std::vector<extent_protocol::extentid_t> ids,
+                                unsigned int clt,
+                                std::vector<extent_protocol::leased_attr> &attrs)
+{
+  printf("extent_server: getattr_many of %zu\n", ids.size());
+
+  attrs.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++)
+    attrs[i].lease = leases.grant(clt, ids[i] & 0x7fffffff);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  for (size_t i = 0; i < ids.size(); i++) {
+    memset(&attrs[i].a, 0, sizeof(attrs[i].a));
+    im->get_attr(ids[i] & 0x7fffffff, attrs[i].a);
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::remove(extent_protocol::extentid_t id, unsigned int clt, int &)
 {
   printf("extent_server: write %lld\n", id);
 
   id &= 0x7fffffff;
+  leases.begin_change(clt, id);
+  std::lock_guard<std::mutex> lock(mtx);
   im->remove_file(id);
+  im->flush();
+  leases.end_change(id);
  
   return extent_protocol::OK;
 }
 
+int extent_server::read(extent_protocol::extentid_t id, uint32_t off, uint32_t len, std::string &buf)
+{
+  printf("extent_server: read %lld off %u len %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+
+  buf.resize(len);
+  std::lock_guard<std::mutex> lock(mtx);
+  int n = im->read_range(id, off, len, &buf[0]);
+  buf.resize(n);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write(extent_protocol::extentid_t id, uint32_t off, std::string_view buf,
+                         unsigned int clt, int &)
+{
+  printf("extent_server: write %lld off %u len %zu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+  leases.begin_change(clt, id);
+  int r = extent_protocol::OK;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (im->write_range(id, off, buf.data(), buf.size()) < 0)
+      r = extent_protocol::IOERR;
+    im->flush();
+  }
+  leases.end_change(id);
+
+  return r;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, uint32_t size,
+                            unsigned int clt, int &)
+{
+  printf("extent_server: truncate %lld size %u\n", id, size);
+
+  id &= 0x7fffffff;
+  leases.begin_change(clt, id);
+  int r = extent_protocol::OK;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (im->truncate(id, size) < 0)
+      r = extent_protocol::IOERR;
+    im->flush();
+  }
+  leases.end_change(id);
+
+  return r;
+}
+
+/* True if every step of ops is well formed. */
+bool extent_server::check_compound(const std::vector<extent_protocol::op> &ops)
+{
+  bool have_created = false;
+  for (size_t i = 0; i < ops.size(); i++) {
+    const extent_protocol::op &o = ops[i];
+    switch (o.proc) {
+    case extent_protocol::create:
+      have_created = true;
+      continue;
+    case extent_protocol::put:
+    case extent_protocol::write:
+    case extent_protocol::truncate:
+    case extent_protocol::remove:
+      break;
+    default:
+      printf("\textent_server: error! bad compound step %u\n", o.proc);
+      return false;
+    }
+    if ((o.id == 0 || o.patch >= 0) && !have_created) {
+      printf("\textent_server: error! compound step %zu has no extent\n", i);
+      return false;
+    }
+    if (o.patch >= 0 && o.patch + sizeof(extent_protocol::extentid_t) > o.buf.size()) {
+      printf("\textent_server: error! compound patch out of range\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Run the steps of ops in order as one change: every extent they name
+ * waits for other clients' leases first, and no other call sees the
+ * steps half done.  Returns the id of the last extent created.
+ * Inodes for the create steps are allocated, and sizes and free blocks
+ * are checked, before any step runs, so a call that fails the checks
+ * changes nothing. */
+int extent_server::compound(std::vector<extent_protocol::op> ops, unsigned int clt,
+                            extent_protocol::extentid_t &created)
+{
+  printf("extent_server: compound of %zu\n", ops.size());
+
+  if (!check_compound(ops))
+    return extent_protocol::IOERR;
+
+  std::set<extent_protocol::extentid_t> ids;
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (ops[i].proc != extent_protocol::create && ops[i].id != 0)
+      ids.insert(ops[i].id & 0x7fffffff);
+  }
+
+  int r = extent_protocol::OK;
+  for (auto id : ids)
+    leases.begin_change(clt, id);
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    const uint32_t max = im->max_file_size();
+    std::vector<uint32_t> inums;
+    uint64_t need = 0;
+    created = 0;
+    for (size_t i = 0; i < ops.size() && r == extent_protocol::OK; i++) {
+      const extent_protocol::op &o = ops[i];
+      bool ok = true;
+      switch (o.proc) {
+      case extent_protocol::create:
+        inums.push_back(im->alloc_inode(o.arg));
+        ok = inums.back() != 0;
+        break;
+      case extent_protocol::put:
+        ok = o.buf.size() <= max;
+        if (ok)
+          need += im->blocks_needed(0, o.buf.size());
+        break;
+      case extent_protocol::write:
+        ok = o.buf.size() <= max && o.arg <= max - o.buf.size();
+        if (ok)
+          need += im->blocks_needed(o.arg, o.buf.size());
+        break;
+      case extent_protocol::truncate:
+        ok = o.arg <= max;
+        break;
+      }
+      if (!ok) {
+        printf("\textent_server: error! compound step %zu cannot be done\n", i);
+        r = extent_protocol::IOERR;
+      }
+    }
+    if (r == extent_protocol::OK && need > im->free_blocks()) {
+      printf("\textent_server: error! compound needs %llu blocks, %u free\n",
+             (unsigned long long) need, im->free_blocks());
+      r = extent_protocol::IOERR;
+    }
+    if (r != extent_protocol::OK) {
+      for (auto inum : inums)
+        im->free_inode(inum);
+      ops.clear();
+    }
+
+    size_t next = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+      extent_protocol::op &o = ops[i];
+      uint32_t id = (o.id ? o.id : created) & 0x7fffffff;
+      if (o.patch >= 0)
+        memcpy(&o.buf[o.patch], &created, sizeof(created));
+      switch (o.proc) {
+      case extent_protocol::create:
+        created = inums[next++];
+        break;
+      case extent_protocol::put:
+        if (im->write_file(id, o.buf.data(), o.buf.size()) < 0)
+          r = extent_protocol::IOERR;
+        break;
+      case extent_protocol::write:
+        if (im->write_range(id, o.arg, o.buf.data(), o.buf.size()) < 0)
+          r = extent_protocol::IOERR;
+        break;
+      case extent_protocol::truncate:
+        if (im->truncate(id, o.arg) < 0)
+          r = extent_protocol::IOERR;
+        break;
+      case extent_protocol::remove:
+        im->remove_file(id);
+        break;
+      }
+    }
+    im->flush();
+  }
+  for (auto id : ids)
+    leases.end_change(id);
+
+  return r;
+}
@@ -4,9 +4,28 @@
 #define extent_server_h
 
 #include <string>
+#include <string_view>
 #include <map>
+#include <mutex>
+#include <vector>
 #include "extent_protocol.h"
 #include "inode_manager.h"
+#include "extent_lease.h"
+
+// Reply of extent_server::get_contents and read_contents.  It goes on
+// the wire exactly like a std::string holding bytes [off, off + len) of
+// the file, cut short at its end, but the file's blocks are read
+// straight into the RPC reply buffer when it is marshalled.
+struct extent_contents {
+  inode_manager *im;
+  std::mutex *mtx;
+  uint32_t inum;
+  uint32_t off;
+  uint32_t len;
+  extent_contents() : im(NULL), mtx(NULL), inum(0), off(0), len(0) {}
+};
+
+marshall &operator<<(marshall &m, const extent_contents &c);
 
 class extent_server {
  protected:
@@ -18,15 +37,35 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // Serialises access to im, so each call, compound ones included,
+  // is applied as a whole.
+  std::mutex mtx;
+  lease_table leases;
 
  public:
-  extent_server();
+  extent_server(const char *image = NULL, uint64_t disk_size = DISK_SIZE,
+                uint32_t block_size = BLOCK_SIZE, uint32_t ninodes = INODE_NUM);
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  int put(extent_protocol::extentid_t id, std::string_view, unsigned int clt, int &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int get_contents(extent_protocol::extentid_t id, extent_contents &);
+  int read_contents(extent_protocol::extentid_t id, uint32_t off, uint32_t len,
+                    extent_contents &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
-  int remove(extent_protocol::extentid_t id, int &);
+  int getattr_lease(extent_protocol::extentid_t id, unsigned int clt,
+                    extent_protocol::leased_attr &);
+  int getattr_many(std::vector<extent_protocol::extentid_t> ids, unsigned int clt,
+                   std::vector<extent_protocol::leased_attr> &);
+  int remove(extent_protocol::extentid_t id, unsigned int clt, int &);
+  int read(extent_protocol::extentid_t id, uint32_t off, uint32_t len, std::string &);
+  int write(extent_protocol::extentid_t id, uint32_t off, std::string_view,
+            unsigned int clt, int &);
+  int truncate(extent_protocol::extentid_t id, uint32_t size, unsigned int clt,
+               int &);
+  int compound(std::vector<extent_protocol::op> ops, unsigned int clt,
+               extent_protocol::extentid_t &created);
+  static bool check_compound(const std::vector<extent_protocol::op> &ops);
 };
 
 #endif 
@@ -1,4 +1,5 @@
  #include "extent_server_dist.h"
+#include <set>
 
 chfs_raft *extent_server_dist::leader() const {
     int leader = this->raft_group->check_exact_one_leader();
@@ -25,8 +26,9 @@ int extent_server_dist::create(uint32_t type, extent_protocol::extentid_t &id) {
     return extent_protocol::OK;
 }
 
-int extent_server_dist::put(extent_protocol::extentid_t id, std::string buf, int &) {
+int extent_server_dist::put(extent_protocol::extentid_t id, std::string buf, unsigned int clt, int &) {
     // Lab3: your code here
+    leases.begin_change(clt, id);
     int term, index;
     chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_PUT;
@@ -38,7 +40,8 @@ int extent_server_dist::put(extent_protocol::extentid_t id, std::string buf, int
         ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
                 "extent_server_dist: put command timeout");
     }
-    return extent_protocol::OK;
+    leases.end_change(id);
+    return cmd.res->ret;
 }
 
 int extent_server_dist::get(extent_protocol::extentid_t id, std::string &buf) {
@@ -53,7 +56,7 @@ int extent_server_dist::get(extent_protocol::extentid_t id, std::string &buf) {
         ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
                 "extent_server_dist: get command timeout");
     }
-    buf = cmd.res->buf;
+    buf.swap(cmd.res->buf);
     return extent_protocol::OK;
 }
 
@@ -73,8 +76,43 @@ int extent_server_dist::getattr(extent_protocol::extentid_t id, extent_protocol:
     return extent_protocol::OK;
 }
 
-int extent_server_dist::remove(extent_protocol::extentid_t id, int &) {
+int extent_server_dist::getattr_lease(extent_protocol::extentid_t id, unsigned int clt,
+                                      extent_protocol::leased_attr &l) {
+    l.lease = leases.grant(clt, id);
+    return getattr(id, l.a);
+}
+
+// All the attributes are read by a single log entry.
+int extent_server_dist::getattr_many(std::vector<extent_protocol::extentid_t> ids, unsigned int clt,
+                                     std::vector<extent_protocol::leased_attr> &attrs) {
+    attrs.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        attrs[i].lease = leases.grant(clt, ids[i]);
+    }
+    int term, index;
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_GETA_MANY;
+    marshall m;
+    m << ids;
+    cmd.buf = m.str();
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    leader()->new_command(cmd, term, index);
+    if (!cmd.res->done) {
+        ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
+                "extent_server_dist: getattr_many command timeout");
+    }
+    std::vector<extent_protocol::attr> a;
+    unmarshall u(cmd.res->buf);
+    u >> a;
+    for (size_t i = 0; i < ids.size() && i < a.size(); i++) {
+        attrs[i].a = a[i];
+    }
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::remove(extent_protocol::extentid_t id, unsigned int clt, int &) {
     // Lab3: your code here
+    leases.begin_change(clt, id);
     int term, index;
     chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_RMV;
@@ -85,9 +123,99 @@ int extent_server_dist::remove(extent_protocol::extentid_t id, int &) {
         ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
                 "extent_server_dist: remove command timeout");
     }
+    leases.end_change(id);
     return extent_protocol::OK;
 }
 
+int extent_server_dist::read(extent_protocol::extentid_t id, uint32_t off, uint32_t len, std::string &buf) {
+    int term, index;
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_READ;
+    cmd.id = id;
+    cmd.off = off;
+    cmd.len = len;
+    leader()->new_command(cmd, term, index);
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    if (!cmd.res->done) {
+        ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
+                "extent_server_dist: read command timeout");
+    }
+    buf = cmd.res->buf;
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::write(extent_protocol::extentid_t id, uint32_t off, std::string buf,
+                              unsigned int clt, int &) {
+    leases.begin_change(clt, id);
+    int term, index;
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_WRITE;
+    cmd.id = id;
+    cmd.off = off;
+    cmd.buf = buf;
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    leader()->new_command(cmd, term, index);
+    if (!cmd.res->done) {
+        ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
+                "extent_server_dist: write command timeout");
+    }
+    leases.end_change(id);
+    return cmd.res->ret;
+}
+
+int extent_server_dist::truncate(extent_protocol::extentid_t id, uint32_t size, unsigned int clt,
+                                 int &) {
+    leases.begin_change(clt, id);
+    int term, index;
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_TRUNC;
+    cmd.id = id;
+    cmd.len = size;
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    leader()->new_command(cmd, term, index);
+    if (!cmd.res->done) {
+        ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
+                "extent_server_dist: truncate command timeout");
+    }
+    leases.end_change(id);
+    return cmd.res->ret;
+}
+
+// All steps go into a single log entry, so they are applied together
+// on every replica.
+int extent_server_dist::compound(std::vector<extent_protocol::op> ops, unsigned int clt,
+                                 extent_protocol::extentid_t &created) {
+    if (!extent_server::check_compound(ops)) {
+        return extent_protocol::IOERR;
+    }
+    std::set<extent_protocol::extentid_t> ids;
+    for (const extent_protocol::op &o : ops) {
+        if (o.proc != extent_protocol::create && o.id != 0) {
+            ids.insert(o.id);
+        }
+    }
+    for (auto id : ids) {
+        leases.begin_change(clt, id);
+    }
+    int term, index;
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_COMPOUND;
+    marshall m;
+    m << ops;
+    cmd.buf = m.str();
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    leader()->new_command(cmd, term, index);
+    if (!cmd.res->done) {
+        ASSERT(cmd.res->cv.wait_until(lock, cmd.res->start + std::chrono::milliseconds(3000)) == std::cv_status::no_timeout,
+                "extent_server_dist: compound command timeout");
+    }
+    created = cmd.res->id;
+    for (auto id : ids) {
+        leases.end_change(id);
+    }
+    return cmd.res->ret;
+}
+
 extent_server_dist::~extent_server_dist() {
     delete this->raft_group;
 }
\ No newline at end of file
@@ -10,11 +10,14 @@
 #include "extent_server.h"
 #include "raft_test_utils.h"
 #include "chfs_state_machine.h"
+#include "extent_lease.h"
 
 using chfs_raft = raft<chfs_state_machine, chfs_command_raft>;
 using chfs_raft_group = raft_group<chfs_state_machine, chfs_command_raft>;
 
 class extent_server_dist {
+    lease_table leases;
+
 public:
     chfs_raft_group *raft_group;
     extent_server_dist(const int num_raft_nodes = 3) {
@@ -24,10 +27,20 @@ public:
     chfs_raft *leader() const;
 
     int create(uint32_t type, extent_protocol::extentid_t &id);
-    int put(extent_protocol::extentid_t id, std::string, int &);
+    int put(extent_protocol::extentid_t id, std::string, unsigned int clt, int &);
     int get(extent_protocol::extentid_t id, std::string &);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
-    int remove(extent_protocol::extentid_t id, int &);
+    int getattr_lease(extent_protocol::extentid_t id, unsigned int clt,
+                      extent_protocol::leased_attr &);
+    int getattr_many(std::vector<extent_protocol::extentid_t> ids, unsigned int clt,
+                     std::vector<extent_protocol::leased_attr> &);
+    int remove(extent_protocol::extentid_t id, unsigned int clt, int &);
+    int read(extent_protocol::extentid_t id, uint32_t off, uint32_t len, std::string &);
+    int write(extent_protocol::extentid_t id, uint32_t off, std::string,
+              unsigned int clt, int &);
+    int truncate(extent_protocol::extentid_t id, uint32_t size, unsigned int clt, int &);
+    int compound(std::vector<extent_protocol::op> ops, unsigned int clt,
+                 extent_protocol::extentid_t &created);
 
     ~extent_server_dist();
 };
@@ -23,13 +23,40 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  // keep the file system in this image file across restarts
+  char *image = getenv("CHFS_DISK_IMAGE");
+
+  // geometry used when formatting a fresh disk
+  uint64_t disk_size = DISK_SIZE;
+  uint32_t block_size = BLOCK_SIZE;
+  uint32_t ninodes = INODE_NUM;
+  char *size_env = getenv("CHFS_DISK_SIZE");
+  if(size_env != NULL){
+    disk_size = strtoull(size_env, NULL, 0);
+  }
+  char *bsize_env = getenv("CHFS_BLOCK_SIZE");
+  if(bsize_env != NULL){
+    block_size = atoi(bsize_env);
+  }
+  char *inodes_env = getenv("CHFS_INODE_NUM");
+  if(inodes_env != NULL){
+    ninodes = atoi(inodes_env);
+  }
+
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(image, disk_size, block_size, ninodes);
 
-  server.reg(extent_protocol::get, &ls, &extent_server::get);
+  server.reg(extent_protocol::get, &ls, &extent_server::get_contents);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
+  server.reg(extent_protocol::getattr_lease, &ls, &extent_server::getattr_lease);
+  server.reg(extent_protocol::getattr_many, &ls, &extent_server::getattr_many);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::read, &ls, &extent_server::read_contents);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
 
   while(1)
     sleep(1000);
@@ -21,6 +21,11 @@
 int myid;
 chfs_client *chfs;
 
+// Seconds the kernel may cache attributes and directory entries, from
+// CHFS_ATTR_TIMEOUT.  When it is above 0, files that have not changed
+// since they were last opened also keep their cached pages on open.
+double cache_timeout = 0.0;
+
 int id() { 
     return myid;
 }
@@ -113,7 +118,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, cache_timeout);
 }
 
 //
@@ -153,7 +158,7 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, cache_timeout);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -257,9 +262,9 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
+    // Timeouts are cache_timeout, and generations are always set to 0
+    e->attr_timeout = cache_timeout;
+    e->entry_timeout = cache_timeout;
     e->generation = 0;
 
     chfs_client::inum inum;
@@ -316,9 +321,9 @@ void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // Timeouts are cache_timeout, and generations are always set to 0
+    e.attr_timeout = cache_timeout;
+    e.entry_timeout = cache_timeout;
     e.generation = 0;
     bool found = false;
 
@@ -342,7 +347,8 @@ struct dirbuf {
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino,
+        mode_t mode = 0)
 {
     struct stat stbuf;
     size_t oldsize = b->size;
@@ -350,6 +356,7 @@ void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
     b->p = (char *) realloc(b->p, b->size);
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
+    stbuf.st_mode = mode;
     fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
 }
 
@@ -389,10 +396,15 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 
     memset(&b, 0, sizeof(b));
 
-    std::list<chfs_client::dirent> entries;
-    chfs->readdir(inum, entries);
-    for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+    // Fetching the attributes along with the names caches them, so the
+    // lookup and getattr the kernel sends for each entry (ls -l) stay
+    // local; the entry types also go into the listing.
+    std::list<chfs_client::dirent_plus> entries;
+    chfs->readdir_plus(inum, entries);
+    for (std::list<chfs_client::dirent_plus>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        mode_t mode = it->attr.type == extent_protocol::T_DIR ? S_IFDIR :
+                      it->attr.type == extent_protocol::T_SYM ? S_IFLNK : S_IFREG;
+        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum, mode);
     }
 
     reply_buf_limited(req, b.p, b.size, off, size);
@@ -404,9 +416,57 @@ void
 fuseserver_open(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *fi)
 {
+    // Let the kernel keep the pages it has cached for a file that has
+    // not changed since it was last opened.
+    bool unchanged = false;
+    if (cache_timeout > 0 && chfs->open(ino, unchanged) != chfs_client::OK) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fi->keep_cache = unchanged;
     fuse_reply_open(req, fi);
 }
 
+//
+// In write-back mode writes are buffered by chfs_client; send them to
+// the extent server when the file is closed or synced.  flush runs on
+// every close() before it returns, so another client that opens the
+// file afterwards sees the data; release comes later and only catches
+// writes made through a mapping after the last close.
+//
+void
+fuseserver_flush(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    if (chfs->flush(ino) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+void
+fuseserver_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    if (chfs->flush(ino) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+void
+fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    if (chfs->flush(ino) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
 //
 // Create a new directory with name @name in parent directory @parent.
 // Leave new directory's inum in e.ino and attributes in e.attr.
@@ -422,9 +482,9 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         mode_t mode)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // Timeouts are cache_timeout, and generations are always set to 0
+    e.attr_timeout = cache_timeout;
+    e.entry_timeout = cache_timeout;
     e.generation = 0;
     // Suppress compiler warning of unused e.
     (void) e;
@@ -518,8 +578,8 @@ void fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, con
     }
 
     e.ino = ino_out;
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    e.attr_timeout = cache_timeout;
+    e.entry_timeout = cache_timeout;
     e.generation = 0;
     ret = getattr(ino_out, e.attr);
 
@@ -558,7 +618,13 @@ main(int argc, char *argv[])
 
     myid = random();
 
-    chfs = new chfs_client(argv[2]);
+    // CHFS_WRITEBACK=1 buffers writes in this client until close/fsync
+    const char *writeback = getenv("CHFS_WRITEBACK");
+    chfs = new chfs_client(argv[2], writeback && atoi(writeback) > 0);
+
+    const char *timeout = getenv("CHFS_ATTR_TIMEOUT");
+    if (timeout)
+        cache_timeout = atof(timeout);
     // chfs = new chfs_client();
 
     fuseserver_oper.getattr    = fuseserver_getattr;
@@ -568,6 +634,9 @@ main(int argc, char *argv[])
     fuseserver_oper.create     = fuseserver_create;
     fuseserver_oper.mknod      = fuseserver_mknod;
     fuseserver_oper.open       = fuseserver_open;
+    fuseserver_oper.flush      = fuseserver_flush;
+    fuseserver_oper.release    = fuseserver_release;
+    fuseserver_oper.fsync      = fuseserver_fsync;
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
     fuseserver_oper.setattr    = fuseserver_setattr;
@@ -589,6 +658,13 @@ main(int argc, char *argv[])
     fuse_argv[fuse_argc++] = "nolocalcaches"; // no dir entry caching
     fuse_argv[fuse_argc++] = "-o";
     fuse_argv[fuse_argc++] = "daemon_timeout=86400";
+#else
+    // let the kernel hand us reads and writes of up to 128 KiB at a
+    // time instead of one page each; extent_client chunks anything bigger
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = "max_read=131072";
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = "max_write=131072,big_writes";
 #endif
 
     // everyone can play, why not?
@@ -631,8 +707,9 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    // Requests are served by several threads; chfs_client locks the
+    // inodes each operation touches.
+    err = fuse_session_loop_mt(se);
 
     fuse_session_destroy(se);
     close(fd);
@@ -0,0 +1,87 @@
+/*
+ * inode layer benchmark.
+ * Write and read back single files of growing size, up to the
+ * largest file the disk can hold, and report the throughput.
+ *
+ * usage: inode_bench [block_size [disk_size_mb]]
+ */
+
+#include "inode_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string>
+#include <sys/time.h>
+
+#define ROUNDS 5
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+bench(inode_manager *im, int size)
+{
+  std::string content(size, 0);
+  for (int i = 0; i < size; i++)
+    content[i] = 'a' + rand() % 26;
+
+  uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+  double wt = 0, rt = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    double t0 = now();
+    im->write_file(inum, content.data(), size);
+    double t1 = now();
+    char *buf = NULL;
+    int out_size = 0;
+    im->read_file(inum, &buf, &out_size);
+    double t2 = now();
+    wt += t1 - t0;
+    rt += t2 - t1;
+
+    if (out_size != size || memcmp(buf, content.data(), size) != 0) {
+      printf("[BENCH_ERROR]: file of %d bytes read back wrong\n", size);
+      free(buf);
+      return 1;
+    }
+    free(buf);
+  }
+  im->remove_file(inum);
+
+  double mb = (double) size * ROUNDS / (1024 * 1024);
+  printf("size %9d B: write %8.1f MB/s (%8.1f us), read %8.1f MB/s (%8.1f us)\n",
+         size, mb / wt, wt * 1e6 / ROUNDS, mb / rt, rt * 1e6 / ROUNDS);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t block_size = argc > 1 ? atoi(argv[1]) : BLOCK_SIZE;
+  uint64_t disk_size = argc > 2 ? atoll(argv[2]) * 1024 * 1024 : DISK_SIZE;
+  inode_manager im(NULL, disk_size, block_size);
+  const superblock_t &sb = im.super();
+
+  // Data blocks left after the superblock, bitmap and inode table,
+  // minus roughly one indirect block per NINDIRECT data blocks.
+  uint64_t data_blocks = sb.nblocks - DBLOCK(sb);
+  uint64_t max_blocks = data_blocks * (NINDIRECT(sb) - 1) / NINDIRECT(sb) - NLEVEL - 1;
+  int max_size = MIN(max_blocks * sb.block_size, (uint64_t) INT_MAX / 2);
+
+  printf("block size %u, %u blocks, %u inodes\n",
+         sb.block_size, sb.nblocks, sb.ninodes);
+
+  srand(1);
+  for (int size = 64 * 1024; size < max_size; size *= 2) {
+    if (bench(&im, size) != 0)
+      return 1;
+  }
+  if (bench(&im, max_size) != 0)
+    return 1;
+  return 0;
+}
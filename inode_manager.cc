@@ -1,229 +1,613 @@
 #include "inode_manager.h"
 #include <ctime>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
 
 // disk layer -----------------------------------------
 
-disk::disk()
+disk::disk(uint64_t size, uint32_t block_size)
+  : size(size), block_size(block_size)
+{
+  blocks = (unsigned char *) calloc(1, size);
+  mapped = false;
+  fresh = true;
+}
+
+// Map the disk image file, creating it with size bytes if it does not exist.
+// An existing image is mapped at its own size.
+// Fall back to an in-memory disk if the image can't be mapped.
+disk::disk(const char *image, uint64_t size, uint32_t block_size)
+  : size(size), block_size(block_size)
+{
+  struct stat st;
+  void *p = MAP_FAILED;
+  int fd = open(image, O_RDWR | O_CREAT, 0644);
+  if (fd >= 0 && fstat(fd, &st) == 0) {
+    fresh = st.st_size == 0;
+    if (!fresh)
+      this->size = st.st_size;
+    if (!fresh || ftruncate(fd, size) == 0)
+      p = mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0)
+    close(fd);
+
+  if (p == MAP_FAILED) {
+    printf("\tdisk: error! can't map image %s, using memory\n", image);
+    this->size = size;
+    blocks = (unsigned char *) calloc(1, size);
+    mapped = false;
+    fresh = true;
+    return;
+  }
+  blocks = (unsigned char *) p;
+  mapped = true;
+}
+
+disk::~disk()
 {
-  bzero(blocks, sizeof(blocks));
+  if (mapped) {
+    msync(blocks, size, MS_SYNC);
+    munmap(blocks, size);
+  } else {
+    free(blocks);
+  }
+}
+
+// Start writing dirty pages of a mapped image back to the file.
+// Doesn't wait; the kernel keeps the pages if only the process dies.
+void
+disk::flush()
+{
+  if (mapped)
+    msync(blocks, size, MS_ASYNC);
 }
 
 void
 disk::read_block(blockid_t id, char *buf)
 {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
-  // printf("Read block->src: %s dest: %s\n", blocks[id], buf);
+  memcpy(buf, blocks + (uint64_t) id * block_size, block_size);
 }
 
 void
 disk::write_block(blockid_t id, const char *buf)
 {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
-  // printf("Write block->src: %s dest: %s\n", buf, blocks[id]);
+  memcpy(blocks + (uint64_t) id * block_size, buf, block_size);
+}
+
+// Read n contiguous blocks starting at id with a single copy.
+void
+disk::read_blocks(blockid_t id, uint32_t n, char *buf)
+{
+  memcpy(buf, blocks + (uint64_t) id * block_size, (uint64_t) n * block_size);
+}
+
+void
+disk::write_blocks(blockid_t id, uint32_t n, const char *buf)
+{
+  memcpy(blocks + (uint64_t) id * block_size, buf, (uint64_t) n * block_size);
 }
 
 // block layer -----------------------------------------
 
+// Write bitmap words [first_word, last_word] back to their bitmap blocks.
+void
+block_manager::sync_bitmap(uint32_t first_word, uint32_t last_word)
+{
+  const uint32_t wpb = WPB(sb);
+  for (uint32_t w = first_word - first_word % wpb; w <= last_word; w += wpb) {
+    uint32_t n = MIN(wpb, (uint32_t) bitmap.size() - w);
+    struct buf *b = getblk(BBLOCK(w * 64, sb), false);
+    memcpy(b->data, &bitmap[w], n * sizeof(uint64_t));
+    memset(b->data + n * sizeof(uint64_t), 0, (wpb - n) * sizeof(uint64_t));
+    bdirty(b);
+    brelse(b);
+  }
+}
+
 // Allocate a free disk block.
+// Return 0 (the superblock, never a data block) if the disk is full.
 blockid_t
 block_manager::alloc_block()
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
-  blockid_t start = IBLOCK(INODE_NUM, sb.nblocks) + 1;
-  for(blockid_t i = start; i < BLOCK_NUM; i++){
-    if(using_blocks[i] == 0){
-      using_blocks[i] = 1;
-      return i;
+  blockid_t id;
+  if (alloc_blocks(1, &id) != 1)
+    return 0;
+  return id;
+}
+
+// Allocate up to n free disk blocks into out[].
+// Search starts at the next-fit cursor and wraps around once.
+// Return the number of blocks actually allocated.
+uint32_t
+block_manager::alloc_blocks(uint32_t n, blockid_t *out)
+{
+  const uint32_t nwords = bitmap.size();
+  uint32_t got = 0;
+  uint32_t first_dirty = nwords, last_dirty = 0;
+
+  for (uint32_t scanned = 0; got < n && scanned < nwords; ) {
+    uint32_t w = next_word;
+    uint64_t free_bits = ~bitmap[w];
+    if (free_bits == 0) {
+      next_word = (w + 1) % nwords;
+      ++scanned;
+      continue;
+    }
+    while (free_bits != 0 && got < n) {
+      int bit = __builtin_ctzll(free_bits);
+      free_bits &= free_bits - 1;
+      bitmap[w] |= 1ULL << bit;
+      out[got++] = w * 64 + bit;
+    }
+    first_dirty = MIN(first_dirty, w);
+    last_dirty = MAX(last_dirty, w);
+  }
+
+  if (got != 0)
+    sync_bitmap(first_dirty, last_dirty);
+  if (got < n)
+    printf("\tbm: error! disk full, allocated %u of %u blocks\n", got, n);
+  return got;
+}
+
+// Allocate one contiguous run of at most n free blocks.
+// The run starts at the first free block after the next-fit cursor.
+// Return the run length (0 if the disk is full) and its first block in start.
+uint32_t
+block_manager::alloc_extent(uint32_t n, blockid_t &start)
+{
+  const uint32_t nwords = bitmap.size();
+
+  for (uint32_t scanned = 0; scanned < nwords; ++scanned) {
+    uint32_t w = next_word;
+    uint64_t free_bits = ~bitmap[w];
+    if (free_bits == 0) {
+      next_word = (w + 1) % nwords;
+      continue;
     }
+
+    start = w * 64 + __builtin_ctzll(free_bits);
+    uint32_t len = 0;
+    for (blockid_t b = start; len < n && b < sb.nblocks; ++b, ++len) {
+      uint64_t mask = 1ULL << (b % 64);
+      if (bitmap[b / 64] & mask)
+        break;
+      bitmap[b / 64] |= mask;
+    }
+    sync_bitmap(start / 64, (start + len - 1) / 64);
+    next_word = ((start + len) / 64) % nwords;
+    return len;
   }
+
+  printf("\tbm: error! disk full\n");
+  return 0;
 }
 
 void
 block_manager::free_block(uint32_t id)
 {
-  /* 
-   * your code goes here.
-   * note: you should unmark the corresponding bit in the block bitmap when free.
-   */
-  if (using_blocks.count(id) != 0) {
-    using_blocks[id] = 0;
+  if (id < DBLOCK(sb) || id >= sb.nblocks)
+    return;
+
+  uint64_t mask = 1ULL << (id % 64);
+  if ((bitmap[id / 64] & mask) == 0)
+    return;
+  bitmap[id / 64] &= ~mask;
+  sync_bitmap(id / 64, id / 64);
+}
+
+// Number of free disk blocks.
+uint32_t
+block_manager::free_count()
+{
+  uint32_t n = 0;
+  for (uint32_t w = 0; w < bitmap.size(); w++)
+    n += __builtin_popcountll(~bitmap[w]);
+  return n;
+}
+
+// Adopt the file system already on the disk if its superblock is sane.
+// The geometry on disk wins over the one asked for.
+bool
+block_manager::load(const superblock_t &want)
+{
+  std::vector<char> buf(want.block_size);
+  superblock_t old;
+
+  d->read_block(0, buf.data());
+  memcpy(&old, buf.data(), sizeof(old));
+  if (old.magic != FS_MAGIC
+      || old.block_size < MIN_BLOCK_SIZE || old.block_size > MAX_BLOCK_SIZE
+      || (old.block_size & (old.block_size - 1)) != 0
+      || old.size != d->get_size()
+      || old.nblocks != old.size / old.block_size / 64 * 64
+      || old.ninodes == 0 || old.ninodes % 64 != 0
+      || DBLOCK(old) >= old.nblocks)
+    return false;
+
+  sb = old;
+  d->set_block_size(sb.block_size);
+  bitmap.assign(sb.nblocks / 64, 0);
+  for (uint32_t w = 0; w < bitmap.size(); w += WPB(sb)) {
+    buf.resize(sb.block_size);
+    d->read_block(BBLOCK(w * 64, sb), buf.data());
+    memcpy(&bitmap[w], buf.data(),
+           MIN(WPB(sb), bitmap.size() - w) * sizeof(uint64_t));
   }
-  return;
+  next_word = DBLOCK(sb) / 64;
+  return true;
+}
+
+// Write a fresh superblock, free block bitmap and inode table.
+void
+block_manager::format(const superblock_t &want)
+{
+  sb = want;
+  std::vector<char> buf(sb.block_size, 0);
+  memcpy(buf.data(), &sb, sizeof(sb));
+  d->write_block(0, buf.data());
+
+  // superblock, bitmap and inode table are never handed out
+  blockid_t start = DBLOCK(sb);
+  memset(buf.data(), 0, sb.block_size);
+  for (blockid_t b = BBLOCK(sb.nblocks, sb); b < start; ++b)
+    d->write_block(b, buf.data());
+  bitmap.assign(sb.nblocks / 64, 0);
+  for (blockid_t b = 0; b < start; ++b)
+    bitmap[b / 64] |= 1ULL << (b % 64);
+  sync_bitmap(0, bitmap.size() - 1);
+  next_word = start / 64;
 }
 
 // The layout of disk should be like this:
 // |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager()
+// The geometry is only used to format a fresh disk: block_size must be
+// a power of two in [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE], ninodes is rounded
+// up and the block count down to a multiple of 64.
+block_manager::block_manager(const char *image, uint64_t disk_size,
+                             uint32_t block_size, uint32_t ninodes)
+{
+  superblock_t want;
+  want.magic = FS_MAGIC;
+  want.block_size = block_size;
+  want.ninodes = (MAX(ninodes, 64U) + 63) / 64 * 64;
+  if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE
+      || (block_size & (block_size - 1)) != 0) {
+    printf("\tbm: error! bad block size %u, using %u\n", block_size, BLOCK_SIZE);
+    want.block_size = BLOCK_SIZE;
+  }
+
+  d = image ? new disk(image, disk_size, want.block_size)
+            : new disk(disk_size, want.block_size);
+
+  // reuse the file system already on a persistent disk
+  if (!d->is_fresh() && d->get_size() >= want.block_size) {
+    if (load(want)) {
+      formatted = false;
+      return;
+    }
+    printf("\tbm: disk image has no valid superblock, formatting\n");
+  }
+
+  want.size = d->get_size();
+  want.nblocks = want.size / want.block_size / 64 * 64;
+  if (want.nblocks == 0 || DBLOCK(want) >= want.nblocks) {
+    printf("\tbm: error! disk of %llu bytes can't hold %u inodes\n",
+           (unsigned long long) want.size, want.ninodes);
+    exit(0);
+  }
+  format(want);
+  formatted = true;
+}
+
+// block cache -----------------------------------------
+
+void
+block_manager::writeback(struct buf *b)
+{
+  if (b->dirty) {
+    d->write_block(b->id, b->data);
+    b->dirty = false;
+    dirty.erase(b->id);
+  }
+}
+
+// Return block id pinned in the cache, reading it from disk if load is
+// set.  Once NBUF blocks are cached the least recently used unpinned one
+// is written back if dirty and reused.
+struct buf *
+block_manager::getblk(blockid_t id, bool load)
+{
+  struct buf *b;
+  auto it = cache.find(id);
+  if (it != cache.end()) {
+    b = it->second;
+    lru.splice(lru.begin(), lru, b->lru);
+    b->refcnt++;
+    return b;
+  }
+
+  b = NULL;
+  if (cache.size() >= NBUF) {
+    for (auto victim = lru.rbegin(); victim != lru.rend(); ++victim) {
+      if ((*victim)->refcnt == 0) {
+        b = *victim;
+        break;
+      }
+    }
+  }
+  if (b != NULL) {
+    writeback(b);
+    cache.erase(b->id);
+    lru.splice(lru.begin(), lru, b->lru);
+  } else {
+    // every buffer is pinned: grow the cache rather than fail
+    b = new buf;
+    b->data = (char *) malloc(sb.block_size);
+    lru.push_front(b);
+    b->lru = lru.begin();
+  }
+
+  b->id = id;
+  b->dirty = false;
+  b->refcnt = 1;
+  if (load)
+    d->read_block(id, b->data);
+  cache[id] = b;
+  return b;
+}
+
+// Return a pinned buffer holding the contents of block id.
+struct buf *
+block_manager::bread(blockid_t id)
+{
+  return getblk(id, true);
+}
+
+// Mark a pinned buffer modified; it reaches the disk on eviction or flush().
+void
+block_manager::bdirty(struct buf *b)
 {
-  d = new disk();
+  if (!b->dirty) {
+    b->dirty = true;
+    dirty.insert(b->id);
+  }
+}
 
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+// Unpin a buffer returned by bread().
+void
+block_manager::brelse(struct buf *b)
+{
+  b->refcnt--;
+}
 
+void
+block_manager::flush()
+{
+  while (!dirty.empty())
+    writeback(cache[*dirty.begin()]);
+  d->flush();
 }
 
 void
 block_manager::read_block(uint32_t id, char *buf)
 {
-  d->read_block(id, buf);
+  struct buf *b = getblk(id, true);
+  memcpy(buf, b->data, sb.block_size);
+  brelse(b);
 }
 
 void
 block_manager::write_block(uint32_t id, const char *buf)
 {
-  d->write_block(id, buf);
+  struct buf *b = getblk(id, false);
+  memcpy(b->data, buf, sb.block_size);
+  bdirty(b);
+  brelse(b);
+}
+
+// Read a run of blocks straight from disk, then patch in the cached
+// blocks of the run that haven't been written back yet.
+void
+block_manager::read_blocks(uint32_t id, uint32_t n, char *buf)
+{
+  d->read_blocks(id, n, buf);
+  for (auto it = dirty.lower_bound(id); it != dirty.end() && *it < id + n; ++it)
+    memcpy(buf + (uint64_t) (*it - id) * sb.block_size, cache[*it]->data,
+           sb.block_size);
+}
+
+// Write a run of blocks straight to disk, refreshing cached copies.
+void
+block_manager::write_blocks(uint32_t id, uint32_t n, const char *buf)
+{
+  d->write_blocks(id, n, buf);
+  for (uint32_t i = 0; i < n; ++i) {
+    auto it = cache.find(id + i);
+    if (it == cache.end())
+      continue;
+    memcpy(it->second->data, buf + (uint64_t) i * sb.block_size, sb.block_size);
+    if (it->second->dirty) {
+      it->second->dirty = false;
+      dirty.erase(id + i);
+    }
+  }
 }
 
 // inode layer -----------------------------------------
 
-inode_manager::inode_manager()
+inode_manager::inode_manager(const char *image, uint64_t disk_size,
+                             uint32_t block_size, uint32_t ninodes)
 {
-  bm = new block_manager();
+  bm = new block_manager(image, disk_size, block_size, ninodes);
+  rebuild_inode_bitmap();
+  if (!bm->formatted)
+    return;
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
     printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
     exit(0);
   }
+  bm->flush();
+}
+
+/* Push file system changes towards stable storage. */
+void
+inode_manager::flush()
+{
+  bm->flush();
+}
+
+/* Rebuild the in-memory free inode bitmap from the inode table.
+ * Inode 0 is never handed out. */
+void
+inode_manager::rebuild_inode_bitmap()
+{
+  std::vector<char> buf(bm->sb.block_size);
+
+  inode_bitmap.assign(bm->sb.ninodes / 64, 0);
+  inode_bitmap[0] |= 1;
+  for (uint32_t inum = 1; inum < bm->sb.ninodes; inum++) {
+    if (inum == 1 || inum % IPB(bm->sb) == 0)
+      bm->read_block(IBLOCK(inum, bm->sb), buf.data());
+    inode_t *ino = (inode_t *) buf.data() + inum % IPB(bm->sb);
+    if (ino->type != 0)
+      inode_bitmap[inum / 64] |= 1ULL << (inum % 64);
+  }
+  next_inode_word = 0;
 }
 
 /* Create a new file.
- * Return its inum. */
+ * Return its inum, or 0 if the inode table is full. */
 uint32_t
 inode_manager::alloc_inode(uint32_t type)
 {
-  /* 
-   * your code goes here.
-   * note: the normal inode block should begin from the 2nd inode block.
-   * the 1st is used for root_dir, see inode_manager::inode_manager().
-   */
-  char buf[BLOCK_SIZE];
+  const uint32_t nwords = inode_bitmap.size();
   inode_t *ino;
-  for(uint32_t inum = 1; inum < INODE_NUM; inum++){
-    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-    ino = (inode_t*)buf + inum%IPB;
-    if(ino->type == 0){
-      ino->type = type;
-      ino->size = 0;
-      bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
-      // printf("alloc_inode->inum: %d\n", inum);
-      return inum;
+
+  for (uint32_t scanned = 0; scanned < nwords; ++scanned) {
+    uint32_t w = next_inode_word;
+    uint64_t free_bits = ~inode_bitmap[w];
+    if (free_bits == 0) {
+      next_inode_word = (w + 1) % nwords;
+      continue;
     }
+
+    uint32_t inum = w * 64 + __builtin_ctzll(free_bits);
+    inode_bitmap[w] |= 1ULL << (inum % 64);
+    struct buf *b = bm->bread(IBLOCK(inum, bm->sb));
+    ino = (inode_t*)b->data + inum%IPB(bm->sb);
+    ino->type = type;
+    ino->size = 0;
+    bm->bdirty(b);
+    bm->brelse(b);
+    return inum;
   }
+
+  printf("\tim: error! no free inode\n");
+  return 0;
 }
 
 void
 inode_manager::free_inode(uint32_t inum)
 {
-  /* 
-   * your code goes here.
-   * note: you need to check if the inode is already a freed one;
-   * if not, clear it, and remember to write back to disk.
-   */
+  uint64_t mask = 1ULL << (inum % 64);
+  if (inum == 0 || inum >= bm->sb.ninodes || (inode_bitmap[inum / 64] & mask) == 0)
+    return;
+
   inode_t *ino_disk = get_inode(inum);
   ino_disk->type = 0;
   ino_disk->size = 0;
   ino_disk->atime = 0;
   ino_disk->mtime = 0;
   ino_disk->ctime = 0;
-  for (int i = 0; i <= NDIRECT; ++i)
-    ino_disk->blocks[i] = 0;
+  memset(ino_disk->blocks, 0, sizeof(ino_disk->blocks));
   
   put_inode(inum, ino_disk);
   delete ino_disk;
+  inode_bitmap[inum / 64] &= ~mask;
   return;
 }
 
 
 /* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
+ * Caller should release the memory with delete. */
 struct inode* 
 inode_manager::get_inode(uint32_t inum)
 {
   inode_t *ino, *ino_disk;
-  char buf[BLOCK_SIZE];
+  struct buf *b = bm->bread(IBLOCK(inum, bm->sb));
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode *)buf + inum % IPB;
-  ino = (inode_t *) malloc(sizeof(inode_t));
+  ino_disk = (struct inode *)b->data + inum % IPB(bm->sb);
+  ino = new inode_t;
   *ino = *ino_disk;
+  bm->brelse(b);
   return ino;
 }
 
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-  char buf[BLOCK_SIZE];
   struct inode *ino_disk;
 
   printf("\tim: put_inode %d\n", inum);
   if (ino == NULL)
     return;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode*)buf + inum%IPB;
+  struct buf *b = bm->bread(IBLOCK(inum, bm->sb));
+  ino_disk = (struct inode*)b->data + inum%IPB(bm->sb);
   *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  bm->bdirty(b);
+  bm->brelse(b);
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
+/* Return true if the n bytes at p are all zero. */
+static bool
+is_zero(const char *p, uint32_t n)
+{
+  return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
 
 /* Get all the data of a file by inum. 
- * Return alloced data, should be freed by caller. */
+ * Return alloced data, should be freed by caller.
+ * The buffer is rounded up to whole blocks so that each contiguous
+ * run of blocks is copied out of the disk with a single memcpy.
+ * Holes read as zeros. */
 void
 inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
 {
-  /*
-   * your code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_out
-   */
-  /* Initialize some variables */
-  char buf[BLOCK_SIZE];
-  char src[BLOCK_SIZE];
-  blockid_t blockIdList[NDIRECT];
+  const uint32_t bs = bm->sb.block_size;
   inode_t *ino_disk = get_inode(inum);
-  int block_num = (ino_disk->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int block_num = (ino_disk->size + bs - 1) / bs;
+  block_map map(bm, ino_disk);
 
   /* Allocate space for buf_out */
-  *buf_out = (char *) malloc(ino_disk->size);
-  memset(*buf_out, 0, ino_disk->size);
-
-  // printf("read_file->inum: %d, block_num: %d\n", inum, block_num);
-
-  /* Copy file content to *buf_out */
-  /* Case1: The inode does not have indirect block */
-  if (block_num <= NDIRECT) {
-    for (int i = 0; i < block_num; ++i) {
-      bm->read_block(ino_disk->blocks[i], src);
-      int trans_size = BLOCK_SIZE;
-      if (i == block_num - 1 && ino_disk->size % BLOCK_SIZE != 0)
-        trans_size = (ino_disk->size - 1) % BLOCK_SIZE + 1;
-      memcpy(*buf_out + i * BLOCK_SIZE, src, trans_size);
-    }
-  }
-  /* Case2: The inode has indirect block */
-  else {
-    /* NDIRECT blocks in ino->disk */
-    for (int i = 0; i < NDIRECT; ++i) {
-      bm->read_block(ino_disk->blocks[i], src);
-      memcpy(*buf_out + i * BLOCK_SIZE, src, BLOCK_SIZE);
-    }
-    /* ino->size - NDIRECT blocks in indirect blocks */
-    int indirect_block_num = block_num - NDIRECT;
-    int indirectId = ino_disk->blocks[NDIRECT];
-    get_indirect_block(indirectId, (int *) blockIdList, indirect_block_num);
-    for (int i = 0; i < indirect_block_num; ++i) {
-      bm->read_block(blockIdList[i], src);
-      int trans_size = BLOCK_SIZE;
-      if (i == indirect_block_num - 1)
-        trans_size = (ino_disk->size - 1) % BLOCK_SIZE + 1;
-      memcpy(*buf_out + i * BLOCK_SIZE + NDIRECT * BLOCK_SIZE, src, trans_size);
+  *buf_out = (char *) malloc(block_num * bs);
+
+  /* Copy file content to *buf_out, one run of contiguous blocks
+   * (or of holes) at a time */
+  int run_start = 0;
+  blockid_t run_id = 0;
+  for (int i = 0; i <= block_num; ++i) {
+    blockid_t id = i < block_num ? map.lookup(i) : 0;
+    blockid_t next = run_id == 0 ? 0 : run_id + (i - run_start);
+    if (i == block_num || id != next) {
+      char *dst = *buf_out + run_start * bs;
+      if (i == run_start)
+        ;
+      else if (run_id == 0)
+        memset(dst, 0, (i - run_start) * bs);
+      else
+        bm->read_blocks(run_id, i - run_start, dst);
+      run_start = i;
+      run_id = id;
     }
   }
 
@@ -232,21 +616,22 @@ inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
   return;
 }
 
-/* alloc/free blocks if needed */
-void
+/* alloc/free blocks if needed.
+ * Blocks of buf that are all zero are left as holes.
+ * Return 0, or -1 if buf is too big or the disk fills up; in the latter
+ * case the file is left empty. */
+int
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
-  /*
-   * your code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf 
-   * is larger or smaller than the size of original inode
-   */
   /* Define some variables */
-  char ino_buf[BLOCK_SIZE];
-  char dest[BLOCK_SIZE];
-  blockid_t alloc_blockId[2 * NDIRECT];
-  int block_num = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  const uint32_t bs = bm->sb.block_size;
+  std::vector<char> dest(bs);
+  int block_num = (size + bs - 1) / bs;
+  int full_num = size / bs;
+  if (block_num > (int) MAXFILE(bm->sb)) {
+    printf("\tim: error! file size %d exceeds MAXFILE\n", size);
+    return -1;
+  }
   inode_t *ino_disk = get_inode(inum);
 
   /* Update time */
@@ -258,40 +643,305 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
   /* Free blocks in inode: inum*/
   free_blocks_in_inode(inum);
 
-  /* Alloc blocks to store buf */
+  /* Find the blocks that hold data */
+  std::vector<blockid_t> blockId(block_num);
+  int data_num = 0;
   for (int i = 0; i < block_num; ++i) {
-    alloc_blockId[i] = bm->alloc_block();
-    if (i != block_num - 1)
-      bm->write_block(alloc_blockId[i], buf + BLOCK_SIZE * i);
-    else {
-      memset(dest, 0, BLOCK_SIZE);
-      memcpy(dest, buf + BLOCK_SIZE * i, (size - 1) % BLOCK_SIZE + 1);
-      bm->write_block(alloc_blockId[i], dest);
+    uint32_t n = MIN(bs, size - i * bs);
+    blockId[i] = is_zero(buf + bs * i, n) ? 0 : 1;
+    data_num += blockId[i];
+  }
+
+  /* Alloc blocks to store buf, followed by the indirect blocks if needed.
+   * Blocks are taken as contiguous extents so reads can copy whole runs. */
+  int alloc_num = data_num + meta_block_num(block_num);
+  std::vector<blockid_t> alloc_blockId(alloc_num);
+  for (int got = 0; got < alloc_num; ) {
+    blockid_t start;
+    uint32_t len = bm->alloc_extent(alloc_num - got, start);
+    if (len == 0) {
+      /* Out of space: the old blocks are gone, leave an empty file */
+      for (int i = 0; i < got; ++i)
+        bm->free_block(alloc_blockId[i]);
+      memset(ino_disk->blocks, 0, sizeof(ino_disk->blocks));
+      ino_disk->size = 0;
+      put_inode(inum, ino_disk);
+      delete ino_disk;
+      return -1;
     }
+    for (uint32_t j = 0; j < len; ++j)
+      alloc_blockId[got++] = start + j;
+  }
+  for (int i = 0, k = 0; i < block_num; ++i) {
+    if (blockId[i] != 0)
+      blockId[i] = alloc_blockId[k++];
+  }
+
+  /* Write full blocks one run at a time, then the zero-padded tail */
+  for (int i = 0; i < full_num; ) {
+    int len = 1;
+    if (blockId[i] == 0) {
+      i += len;
+      continue;
+    }
+    while (i + len < full_num && blockId[i + len] == blockId[i] + len)
+      ++len;
+    bm->write_blocks(blockId[i], len, buf + bs * i);
+    i += len;
+  }
+  if (full_num != block_num && blockId[full_num] != 0) {
+    memset(dest.data(), 0, bs);
+    memcpy(dest.data(), buf + bs * full_num, size - bs * full_num);
+    bm->write_block(blockId[full_num], dest.data());
   }
 
   /* Update ino->blocks */
-  /* Case1: The inode does not have indirect blocks */
-  if (block_num <= NDIRECT) {
-    for (int i = 0; i < block_num; ++i) {
-      ino_disk->blocks[i] = alloc_blockId[i];
+  memset(ino_disk->blocks, 0, sizeof(ino_disk->blocks));
+  int direct_num = MIN(block_num, NDIRECT);
+  for (int i = 0; i < direct_num; ++i)
+    ino_disk->blocks[i] = blockId[i];
+
+  /* Map the rest through the indirect trees, smallest first */
+  const blockid_t *meta = alloc_blockId.data() + data_num;
+  uint32_t done = direct_num;
+  for (int level = 1; level <= NLEVEL && done < (uint32_t) block_num; ++level) {
+    uint32_t n = MIN(block_num - done, tree_capacity(level));
+    ino_disk->blocks[NDIRECT + level - 1] =
+      write_tree(level, blockId.data() + done, n, meta);
+    done += n;
+  }
+  
+  /* Commit changes */
+  ino_disk->size = size;
+  put_inode(inum, ino_disk);
+  delete ino_disk;
+  return 0;
+}
+
+/* Largest file size in bytes: bounded by the block map and by the
+ * 32-bit size field of the inode. */
+uint32_t
+inode_manager::max_file_size()
+{
+  return MIN((uint64_t) MAXFILE(bm->sb) * bm->sb.block_size, (uint64_t) UINT32_MAX);
+}
+
+/* Most blocks that writing [off, off + len) can allocate: every block
+ * it covers plus the indirect blocks of a file ending there.  The range
+ * must fit in a file. */
+uint32_t
+inode_manager::blocks_needed(uint32_t off, uint32_t len)
+{
+  const uint32_t bs = bm->sb.block_size;
+  if (len == 0)
+    return 0;
+  uint32_t first = off / bs;
+  uint32_t last = ((uint64_t) off + len - 1) / bs;
+  return last - first + 1 + meta_block_num(last + 1);
+}
+
+/* Read at most len bytes starting at off into buf.
+ * Only the blocks covering [off, off + len) are touched; holes read
+ * as zeros.  Return the number of bytes read. */
+int
+inode_manager::read_range(uint32_t inum, uint32_t off, uint32_t len, char *buf)
+{
+  const uint32_t bs = bm->sb.block_size;
+  const uint32_t max = max_file_size();
+  /* Nothing lies past the largest file; clamp before any arithmetic */
+  if (off > max)
+    return 0;
+  len = MIN(len, max - off);
+  std::vector<char> src(bs);
+  inode_t *ino_disk = get_inode(inum);
+  if (off >= ino_disk->size) {
+    delete ino_disk;
+    return 0;
+  }
+  len = MIN(len, ino_disk->size - off);
+  block_map map(bm, ino_disk);
+
+  uint32_t pos = off, end = off + len;
+  while (pos < end) {
+    uint32_t b = pos / bs;
+    uint32_t boff = pos % bs;
+    uint32_t n = MIN(bs - boff, end - pos);
+    blockid_t id = map.lookup(b);
+    /* Whole blocks: copy the contiguous run (or zero the holes) in one go */
+    if (n == bs) {
+      uint32_t run = 1;
+      while ((uint64_t) (b + run + 1) * bs <= end
+             && map.lookup(b + run) == (id == 0 ? 0 : id + run))
+        ++run;
+      if (id == 0)
+        memset(buf + (pos - off), 0, run * bs);
+      else
+        bm->read_blocks(id, run, buf + (pos - off));
+      pos += run * bs;
+    }
+    /* Partial block at either end */
+    else {
+      if (id == 0)
+        memset(buf + (pos - off), 0, n);
+      else {
+        bm->read_block(id, src.data());
+        memcpy(buf + (pos - off), src.data() + boff, n);
+      }
+      pos += n;
+    }
+  }
+
+  delete ino_disk;
+  return len;
+}
+
+/* Write len bytes from buf at offset off, growing the file if needed.
+ * Only the blocks covering [off, off + len) are allocated or rewritten;
+ * anything skipped over past the old end of file is left as a hole.
+ * Return 0, or -1 if the range does not fit in a file or the disk
+ * fills up; in the latter case only a prefix of buf may be written. */
+int
+inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf, uint32_t len)
+{
+  const uint32_t bs = bm->sb.block_size;
+  const uint32_t max = max_file_size();
+  if (off > max || len > max - off) {
+    printf("\tim: error! write off %u len %u exceeds MAXFILE\n", off, len);
+    return -1;
+  }
+  std::vector<char> dest(bs);
+  inode_t *ino_disk = get_inode(inum);
+  int r = 0;
+  uint32_t end = off + len;
+  uint32_t new_size = MAX(ino_disk->size, end);
+  block_map map(bm, ino_disk);
+
+  /* Map the blocks covering [off, end), filling holes with new extents */
+  uint32_t first = off / bs;
+  uint32_t num = len == 0 ? 0 : (end - 1) / bs - first + 1;
+  std::vector<blockid_t> ids(num);
+  std::vector<bool> fresh(num, false);
+  for (uint32_t i = 0; i < num; ) {
+    ids[i] = map.lookup(first + i);
+    if (ids[i] != 0) {
+      ++i;
+      continue;
+    }
+    uint32_t holes = 1;
+    while (i + holes < num && map.lookup(first + i + holes) == 0)
+      ++holes;
+    blockid_t start;
+    uint32_t got = bm->alloc_extent(holes, start);
+    uint32_t j = 0;
+    for (; j < got && map.assign(first + i + j, start + j); ++j) {
+      ids[i + j] = start + j;
+      fresh[i + j] = true;
+    }
+    for (uint32_t k = j; k < got; ++k)
+      bm->free_block(start + k);
+    i += j;
+    /* Out of space: keep what could be mapped */
+    if (j < got || got == 0) {
+      printf("\tim: error! disk full writing %u bytes at %u\n", len, off);
+      r = -1;
+      num = i;
+      end = MAX((uint64_t) off, MIN((uint64_t) end, (uint64_t) (first + num) * bs));
+      new_size = end > off ? MAX(ino_disk->size, end) : ino_disk->size;
+      break;
     }
   }
-  /* Case2: The inode has indirect blocks */
-  else {
-    for (int i = 0; i < NDIRECT; ++i) {
-      ino_disk->blocks[i] = alloc_blockId[i];
+
+  /* Overwrite the blocks covering [off, end) */
+  uint32_t pos = off;
+  while (pos < end) {
+    uint32_t i = pos / bs - first;
+    uint32_t boff = pos % bs;
+    uint32_t n = MIN(bs - boff, end - pos);
+    if (n == bs) {
+      uint32_t run = 1;
+      while (pos + (uint64_t) (run + 1) * bs <= end && ids[i + run] == ids[i] + run)
+        ++run;
+      bm->write_blocks(ids[i], run, buf + (pos - off));
+      n = run * bs;
+    } else {
+      if (fresh[i])
+        memset(dest.data(), 0, bs);
+      else
+        bm->read_block(ids[i], dest.data());
+      memcpy(dest.data() + boff, buf + (pos - off), n);
+      bm->write_block(ids[i], dest.data());
     }
-    blockid_t blockId = bm->alloc_block();
-    ino_disk->blocks[NDIRECT] = blockId;
-    write_indirect_block(blockId, (int *) alloc_blockId + NDIRECT, block_num - NDIRECT);
+    pos += n;
   }
-  
+  map.flush();
+
+  /* Commit changes */
+  std::time_t t = std::time(0);
+  ino_disk->mtime = t;
+  ino_disk->ctime = t;
+  ino_disk->size = new_size;
+  put_inode(inum, ino_disk);
+  delete ino_disk;
+  return r;
+}
+
+/* Set the size of a file without rewriting it.
+ * Shrinking frees the blocks past the new end and zeroes the rest of the
+ * new last block; growing only moves the end of file, leaving a hole.
+ * Return 0, or -1 if size exceeds the largest file. */
+int
+inode_manager::truncate(uint32_t inum, uint32_t size)
+{
+  const uint32_t bs = bm->sb.block_size;
+  inode_t *ino_disk = get_inode(inum);
+  uint32_t old_num = (ino_disk->size + bs - 1) / bs;
+  uint32_t keep = (size + bs - 1) / bs;
+  if (keep > MAXFILE(bm->sb)) {
+    printf("\tim: error! file size %u exceeds MAXFILE\n", size);
+    delete ino_disk;
+    return -1;
+  }
+
+  /* Free the blocks from keep on, direct blocks first */
+  if (keep < old_num) {
+    uint32_t done = MIN(old_num, (uint32_t) NDIRECT);
+    for (uint32_t i = keep; i < done; ++i) {
+      bm->free_block(ino_disk->blocks[i]);
+      ino_disk->blocks[i] = 0;
+    }
+    for (int level = 1; level <= NLEVEL && done < old_num; ++level) {
+      uint32_t n = MIN(old_num - done, tree_capacity(level));
+      uint32_t k = keep > done ? keep - done : 0;
+      blockid_t &root = ino_disk->blocks[NDIRECT + level - 1];
+      if (k < n && root != 0) {
+        truncate_tree(level, root, n, k);
+        if (k == 0)
+          root = 0;
+      }
+      done += n;
+    }
+  }
+
+  /* Bytes past the end of file must read as zeros if it grows again */
+  if (size < ino_disk->size && size % bs != 0) {
+    block_map map(bm, ino_disk);
+    blockid_t id = map.lookup(size / bs);
+    if (id != 0) {
+      std::vector<char> dest(bs);
+      bm->read_block(id, dest.data());
+      memset(dest.data() + size % bs, 0, bs - size % bs);
+      bm->write_block(id, dest.data());
+    }
+  }
+
   /* Commit changes */
+  std::time_t t = std::time(0);
+  ino_disk->mtime = t;
+  ino_disk->ctime = t;
   ino_disk->size = size;
   put_inode(inum, ino_disk);
   delete ino_disk;
-  return;
+  return 0;
 }
 
 void
@@ -302,7 +952,6 @@ inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a)
    * note: get the attributes of inode inum.
    * you can refer to "struct attr" in extent_protocol.h
    */
-  char buf[BLOCK_SIZE];
   inode_t *ino_disk;
 
   ino_disk = get_inode(inum);
@@ -331,9 +980,9 @@ inode_manager::remove_file(uint32_t inum)
 void
 inode_manager::get_indirect_block(blockid_t indirectId, int* idList, int size)
 {
-  char buf[BLOCK_SIZE];
-  bm->read_block(indirectId, buf);
-  memcpy(idList, buf, sizeof(int) * size);
+  std::vector<char> buf(bm->sb.block_size);
+  bm->read_block(indirectId, buf.data());
+  memcpy(idList, buf.data(), sizeof(int) * size);
   // printf("get_indirect_block->indirect block id: %d\n", indirectId);
   // printf("get_indirect_block->indirect buf: %s\n", buf);
   // printf("get_indirect_block->indirect block content: ");
@@ -345,31 +994,247 @@ inode_manager::get_indirect_block(blockid_t indirectId, int* idList, int size)
 void
 inode_manager::write_indirect_block(blockid_t indirectId, int* idList, int size)
 {
-  char buf[BLOCK_SIZE];
-  memcpy(buf, idList, sizeof(int) * size);
-  bm->write_block(indirectId, buf);
+  std::vector<char> buf(bm->sb.block_size, 0);
+  memcpy(buf.data(), idList, sizeof(int) * size);
+  bm->write_block(indirectId, buf.data());
   // printf("write_indirect_block->indirect block content: ");
   // for (int i = 0; i < size; ++i)
   //   std::cout << idList[i] << " ";
   // printf("\nwrite_indirect_block->indirect buf: %s\n", buf);
 }
 
+/* Number of data blocks mapped by a full indirect tree of the given level. */
+uint32_t
+inode_manager::tree_capacity(int level)
+{
+  uint32_t cap = 1;
+  for (int i = 0; i < level; ++i)
+    cap *= NINDIRECT(bm->sb);
+  return cap;
+}
+
+/* Number of indirect blocks in a level-deep tree mapping n data blocks. */
+uint32_t
+inode_manager::tree_meta_num(int level, uint32_t n)
+{
+  if (level == 1)
+    return 1;
+  uint32_t per = tree_capacity(level - 1);
+  uint32_t total = 1;
+  for (uint32_t off = 0; off < n; off += per)
+    total += tree_meta_num(level - 1, MIN(per, n - off));
+  return total;
+}
+
+/* Number of indirect blocks needed to map block_num data blocks. */
+uint32_t
+inode_manager::meta_block_num(uint32_t block_num)
+{
+  uint32_t total = 0;
+  uint32_t done = MIN(block_num, (uint32_t) NDIRECT);
+  for (int level = 1; level <= NLEVEL && done < block_num; ++level) {
+    uint32_t n = MIN(block_num - done, tree_capacity(level));
+    total += tree_meta_num(level, n);
+    done += n;
+  }
+  return total;
+}
+
+/* Write a level-deep indirect tree mapping ids[0, n).
+ * Indirect blocks are taken from meta in pre-order.
+ * Return the root block. */
+blockid_t
+inode_manager::write_tree(int level, const blockid_t *ids, uint32_t n,
+                          const blockid_t *&meta)
+{
+  blockid_t self = *meta++;
+  if (level == 1) {
+    write_indirect_block(self, (int *) ids, n);
+    return self;
+  }
+
+  std::vector<blockid_t> children(NINDIRECT(bm->sb));
+  uint32_t per = tree_capacity(level - 1);
+  uint32_t nchild = 0;
+  for (uint32_t off = 0; off < n; off += per)
+    children[nchild++] = write_tree(level - 1, ids + off, MIN(per, n - off), meta);
+  write_indirect_block(self, (int *) children.data(), nchild);
+  return self;
+}
+
+/* Free a level-deep indirect tree mapping n data blocks,
+ * including the data blocks themselves. */
+void
+inode_manager::free_tree(int level, blockid_t id, uint32_t n)
+{
+  std::vector<blockid_t> children(NINDIRECT(bm->sb));
+  uint32_t per = tree_capacity(level - 1);
+  uint32_t nchild = (n + per - 1) / per;
+
+  get_indirect_block(id, (int *) children.data(), nchild);
+  for (uint32_t i = 0; i < nchild; ++i) {
+    if (children[i] == 0)
+      continue;
+    if (level == 1)
+      bm->free_block(children[i]);
+    else
+      free_tree(level - 1, children[i], MIN(per, n - i * per));
+  }
+  bm->free_block(id);
+}
+
+/* Free the data blocks from keep on in a level-deep indirect tree mapping
+ * n data blocks, along with indirect blocks left empty.
+ * The root itself is freed if keep is 0. */
+void
+inode_manager::truncate_tree(int level, blockid_t id, uint32_t n, uint32_t keep)
+{
+  if (keep == 0) {
+    free_tree(level, id, n);
+    return;
+  }
+
+  std::vector<blockid_t> children(NINDIRECT(bm->sb));
+  uint32_t per = tree_capacity(level - 1);
+  uint32_t nchild = (n + per - 1) / per;
+
+  get_indirect_block(id, (int *) children.data(), nchild);
+  for (uint32_t i = keep / per; i < nchild; ++i) {
+    uint32_t k = keep > i * per ? keep - i * per : 0;
+    if (children[i] == 0)
+      continue;
+    if (level == 1)
+      bm->free_block(children[i]);
+    else
+      truncate_tree(level - 1, children[i], MIN(per, n - i * per), k);
+    if (k == 0)
+      children[i] = 0;
+  }
+  write_indirect_block(id, (int *) children.data(), nchild);
+}
+
 void
 inode_manager::free_blocks_in_inode(uint32_t inum)
 {
+  const uint32_t bs = bm->sb.block_size;
   inode_t *ino = get_inode(inum);
-  int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  if (block_num <= NDIRECT) {
-    for (int i = 0; i < block_num; ++i)
-      bm->free_block(ino->blocks[i]);
-  }
-  else {
-    for (int i = 0; i < NDIRECT; ++i) 
-      bm->free_block(ino->blocks[i]);
-    int blockIdList[NDIRECT];
-    int indirectId = ino->blocks[NDIRECT];
-    get_indirect_block(indirectId, blockIdList, block_num - NDIRECT);
-    for (int i = 0; i < block_num - NDIRECT; ++i)
-      bm->free_block(blockIdList[i]);
+  uint32_t block_num = (ino->size + bs - 1) / bs;
+  uint32_t done = MIN(block_num, (uint32_t) NDIRECT);
+
+  for (uint32_t i = 0; i < done; ++i)
+    bm->free_block(ino->blocks[i]);
+  for (int level = 1; level <= NLEVEL && done < block_num; ++level) {
+    uint32_t n = MIN(block_num - done, tree_capacity(level));
+    if (ino->blocks[NDIRECT + level - 1] != 0)
+      free_tree(level, ino->blocks[NDIRECT + level - 1], n);
+    done += n;
+  }
+  delete ino;
+}
+
+// block map -----------------------------------------
+
+block_map::block_map(block_manager *bm, inode_t *ino)
+  : bm(bm), ino(ino), nindirect(NINDIRECT(bm->sb))
+{
+  for (int i = 0; i < NLEVEL; ++i) {
+    cached_id[i] = 0;
+    cached[i].resize(nindirect);
+    dirty[i] = false;
+  }
+}
+
+void
+block_map::writeback(int depth)
+{
+  if (dirty[depth]) {
+    bm->write_block(cached_id[depth], (const char *) cached[depth].data());
+    dirty[depth] = false;
+  }
+}
+
+/* Return the contents of indirect block id, read at most once per depth. */
+blockid_t *
+block_map::indirect(int depth, blockid_t id)
+{
+  if (cached_id[depth] != id) {
+    writeback(depth);
+    bm->read_block(id, (char *) cached[depth].data());
+    cached_id[depth] = id;
   }
+  return cached[depth].data();
+}
+
+/* Return the disk block holding file block n, or 0 if it is a hole. */
+blockid_t
+block_map::lookup(uint32_t n)
+{
+  if (n < NDIRECT)
+    return ino->blocks[n];
+  n -= NDIRECT;
+
+  uint32_t cap = 1;
+  for (int level = 1; level <= NLEVEL; ++level) {
+    cap *= nindirect;
+    if (n < cap) {
+      blockid_t id = ino->blocks[NDIRECT + level - 1];
+      for (int depth = 0; depth < level && id != 0; ++depth) {
+        cap /= nindirect;
+        id = indirect(depth, id)[n / cap];
+        n %= cap;
+      }
+      return id;
+    }
+    n -= cap;
+  }
+  return 0;
+}
+
+/* Map file block n to disk block id, allocating missing indirect blocks.
+ * Return false if an indirect block could not be allocated. */
+bool
+block_map::assign(uint32_t n, blockid_t id)
+{
+  if (n < NDIRECT) {
+    ino->blocks[n] = id;
+    return true;
+  }
+  n -= NDIRECT;
+
+  uint32_t cap = 1;
+  for (int level = 1; level <= NLEVEL; ++level) {
+    cap *= nindirect;
+    if (n < cap) {
+      blockid_t *slot = &ino->blocks[NDIRECT + level - 1];
+      for (int depth = 0; depth < level; ++depth) {
+        if (*slot == 0) {
+          blockid_t fresh = bm->alloc_block();
+          if (fresh == 0)
+            return false;
+          *slot = fresh;
+          if (depth > 0)
+            dirty[depth - 1] = true;
+          writeback(depth);
+          memset(cached[depth].data(), 0, nindirect * sizeof(blockid_t));
+          cached_id[depth] = fresh;
+          dirty[depth] = true;
+        }
+        cap /= nindirect;
+        slot = &indirect(depth, *slot)[n / cap];
+        n %= cap;
+      }
+      *slot = id;
+      dirty[level - 1] = true;
+      return true;
+    }
+    n -= cap;
+  }
+  return false;
+}
+
+void
+block_map::flush()
+{
+  for (int depth = 0; depth < NLEVEL; ++depth)
+    writeback(depth);
 }
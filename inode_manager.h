@@ -4,94 +4,232 @@
 #define inode_h
 
 #include <stdint.h>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include "extent_protocol.h"
 
+// Default geometry used when a disk is formatted.  The geometry a disk
+// was formatted with is recorded in its superblock and read back from
+// there, so these only matter for fresh disks.
 #define DISK_SIZE  1024*1024*16
 #define BLOCK_SIZE 512
 #define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
+#define INODE_NUM  1024
+
+// Block sizes accepted at format time (powers of two).
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 4096
 
 typedef uint32_t blockid_t;
 
 // disk layer -----------------------------------------
 
+// Blocks live either in process memory (the default, zeroed on start)
+// or in a disk image file mapped with mmap, which survives restarts.
+// An existing image keeps its size; a new one is created with size bytes.
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  uint64_t size;
+  uint32_t block_size;
+  bool mapped;
+  bool fresh;
 
  public:
-  disk();
+  disk(uint64_t size, uint32_t block_size);
+  disk(const char *image, uint64_t size, uint32_t block_size);
+  ~disk();
+  // True if the disk holds no earlier file system and must be formatted.
+  bool is_fresh() { return fresh; }
+  uint64_t get_size() { return size; }
+  void set_block_size(uint32_t bs) { block_size = bs; }
+  void flush();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t n, char *buf);
+  void write_blocks(uint32_t id, uint32_t n, const char *buf);
 };
 
 // block layer -----------------------------------------
 
+#define FS_MAGIC 0x63686673  // "chfs"
+
 typedef struct superblock {
-  uint32_t size;
+  uint32_t magic;
+  uint32_t block_size;
   uint32_t nblocks;
   uint32_t ninodes;
+  uint64_t size;
 } superblock_t;
 
+// Bitmap words per bitmap block
+#define WPB(sb)       ((sb).block_size / sizeof(uint64_t))
+
+// Bitmap bits per block
+#define BPB(sb)       ((sb).block_size * 8)
+
+// Block containing bit for block b
+#define BBLOCK(b, sb) ((b)/BPB(sb) + 2)
+
+// Number of blocks kept in the buffer cache.
+#define NBUF 1024
+
+// A disk block held in the buffer cache.
+// A buffer returned by block_manager::bread() is pinned: it stays in the
+// cache, at the same address, until it is handed back with brelse().
+struct buf {
+  blockid_t id;
+  bool dirty;
+  int refcnt;
+  char *data;
+  std::list<struct buf *>::iterator lru;
+};
+
+// Single-block reads and writes go through an LRU buffer cache, so hot
+// inode, bitmap and indirect blocks stay resident and repeated writes to
+// a block reach the disk once, on eviction or flush().  Multi-block runs
+// bypass the cache but stay coherent with it.
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  // Buffer cache: cached blocks by id, in LRU order (front is most
+  // recently used), and the dirty ones in block order.
+  std::unordered_map<blockid_t, struct buf *> cache;
+  std::list<struct buf *> lru;
+  std::set<blockid_t> dirty;
+  struct buf *getblk(blockid_t id, bool load);
+  void writeback(struct buf *b);
+  // In-memory mirror of the on-disk free block bitmap, one bit per block.
+  std::vector<uint64_t> bitmap;
+  // Next-fit cursor: word index where the next search starts.
+  uint32_t next_word;
+  void sync_bitmap(uint32_t first_word, uint32_t last_word);
+  bool load(const superblock_t &want);
+  void format(const superblock_t &want);
  public:
-  block_manager();
+  block_manager(const char *image = NULL, uint64_t disk_size = DISK_SIZE,
+                uint32_t block_size = BLOCK_SIZE, uint32_t ninodes = INODE_NUM);
   struct superblock sb;
+  // True if the disk was formatted by this block_manager.
+  bool formatted;
+  // Write dirty buffers back and push them towards stable storage.
+  void flush();
+
+  struct buf *bread(blockid_t id);
+  void bdirty(struct buf *b);
+  void brelse(struct buf *b);
 
   uint32_t alloc_block();
+  uint32_t alloc_blocks(uint32_t n, blockid_t *out);
+  uint32_t alloc_extent(uint32_t n, blockid_t &start);
   void free_block(uint32_t id);
+  uint32_t free_count();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t n, char *buf);
+  void write_blocks(uint32_t id, uint32_t n, const char *buf);
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM  1024
-
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB(sb)       ((sb).block_size / sizeof(struct inode))
 
 // Block containing inode i
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
-
-// Bitmap bits per block
-#define BPB           (BLOCK_SIZE*8)
+#define IBLOCK(i, sb) (((sb).nblocks + BPB(sb) - 1)/BPB(sb) + (i)/IPB(sb) + 3)
+
+// First data block
+#define DBLOCK(sb)    (IBLOCK((sb).ninodes, sb) + 1)
+
+// The block map is part of the fixed 128-byte inode, so NDIRECT stays
+// a compile-time constant; the indirect fan-out follows the block size.
+#define NDIRECT 24
+#define NINDIRECT(sb) ((sb).block_size / sizeof(blockid_t))
+// Levels of indirection: single, double and triple
+#define NLEVEL 3
+#define MAXFILE(sb)   (NDIRECT + NINDIRECT(sb) + NINDIRECT(sb) * NINDIRECT(sb) \
+                       + NINDIRECT(sb) * NINDIRECT(sb) * NINDIRECT(sb))
+
+// On-disk inode, 128 bytes so that several inodes share one block.
+// blocks[NDIRECT + d - 1] is the root of the d-level indirect tree,
+// for d = 1 (indirect), 2 (double indirect) and 3 (triple indirect).
+// A block address of 0, here or in an indirect block, is a hole that
+// reads as zeros; block 0 holds the superblock so it is never file data.
+typedef struct inode {
+  uint16_t type;
+  uint16_t pad;
+  uint32_t size;
+  uint32_t atime;
+  uint32_t mtime;
+  uint32_t ctime;
+  blockid_t blocks[NDIRECT+NLEVEL];   // Data block addresses
+} inode_t;
 
-// Block containing bit for block b
-#define BBLOCK(b) ((b)/BPB + 2)
+static_assert(MIN_BLOCK_SIZE % sizeof(inode_t) == 0,
+              "inodes must tile a block exactly");
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// Maps file block numbers of one inode to disk blocks.
+// The last indirect block read at each depth is cached, so walking a
+// file in order reads every indirect block once and each lookup is O(1).
+// assign() updates the inode and cached blocks in place; call flush()
+// to write modified indirect blocks back before dropping the map.
+class block_map {
+ private:
+  block_manager *bm;
+  inode_t *ino;
+  uint32_t nindirect;
+  blockid_t cached_id[NLEVEL];
+  std::vector<blockid_t> cached[NLEVEL];
+  bool dirty[NLEVEL];
+  blockid_t *indirect(int depth, blockid_t id);
+  void writeback(int depth);
 
-typedef struct inode {
-  short type;
-  unsigned int size;
-  unsigned int atime;
-  unsigned int mtime;
-  unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
-} inode_t;
+ public:
+  block_map(block_manager *bm, inode_t *ino);
+  blockid_t lookup(uint32_t n);
+  bool assign(uint32_t n, blockid_t id);
+  void flush();
+};
 
 class inode_manager {
  private:
   block_manager *bm;
+  // In-memory free inode bitmap, rebuilt from the inode table at startup.
+  std::vector<uint64_t> inode_bitmap;
+  // Next-fit cursor: word index where the next search starts.
+  uint32_t next_inode_word;
+  void rebuild_inode_bitmap();
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
 
  public:
-  inode_manager();
+  inode_manager(const char *image = NULL, uint64_t disk_size = DISK_SIZE,
+                uint32_t block_size = BLOCK_SIZE, uint32_t ninodes = INODE_NUM);
+  const superblock_t &super() { return bm->sb; }
+  uint32_t max_file_size();
+  uint32_t blocks_needed(uint32_t off, uint32_t len);
+  uint32_t free_blocks() { return bm->free_count(); }
+  void flush();
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
-  void write_file(uint32_t inum, const char *buf, int size);
+  int write_file(uint32_t inum, const char *buf, int size);
+  int read_range(uint32_t inum, uint32_t off, uint32_t len, char *buf);
+  int write_range(uint32_t inum, uint32_t off, const char *buf, uint32_t len);
+  int truncate(uint32_t inum, uint32_t size);
   void remove_file(uint32_t inum);
   void get_attr(uint32_t inum, extent_protocol::attr &a);
   void get_indirect_block(blockid_t indirectId, int* idList, int size);
   void write_indirect_block(blockid_t indirectId, int* idList, int size);
+  blockid_t write_tree(int level, const blockid_t *ids, uint32_t n,
+                       const blockid_t *&meta);
+  void free_tree(int level, blockid_t id, uint32_t n);
+  void truncate_tree(int level, blockid_t id, uint32_t n, uint32_t keep);
+  uint32_t tree_capacity(int level);
+  uint32_t tree_meta_num(int level, uint32_t n);
+  uint32_t meta_block_num(uint32_t block_num);
   void free_blocks_in_inode(uint32_t inum);
 };
 
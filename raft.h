@@ -3,11 +3,14 @@
 
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <thread>
 #include <ctime>
 #include <algorithm>
 #include <thread>
+#include <deque>
+#include <functional>
 #include <stdarg.h>
 
 #include "rpc.h"
@@ -67,7 +70,15 @@ public:
 
 private:
     std::mutex mtx; // A big lock to protect the whole data structure
-    ThrPool *thread_pool;
+
+    // RPCs are sent with rpcc::async_call.  Their replies arrive on the
+    // RPC layer's event loop, which must not block, so they are queued
+    // for background_reply to handle; stop() waits for the outstanding ones.
+    std::mutex rpc_mtx;
+    std::condition_variable rpc_done;
+    std::condition_variable reply_ready;
+    std::deque<std::function<void()>> replies;
+    int rpc_inflight;
     raft_storage<command> *storage; // To persist the raft log
     state_machine *state;           // The state machine that applies the raft log, e.g. a kv store
 
@@ -90,6 +101,7 @@ private:
     std::thread *background_ping;
     std::thread *background_commit;
     std::thread *background_apply;
+    std::thread *background_reply;
 
     // Your code here:
 
@@ -127,6 +139,10 @@ private:
     void send_install_snapshot(int target, install_snapshot_args arg);
     void handle_install_snapshot_reply(int target, const install_snapshot_args &arg, const install_snapshot_reply &reply);
 
+    void begin_rpc();
+    void end_rpc();
+    void queue_reply(std::function<void()> handle);
+
 private:
     bool is_stopped();
     int num_nodes() {
@@ -138,6 +154,7 @@ private:
     void run_background_election();
     void run_background_commit();
     void run_background_apply();
+    void run_background_reply();
 
     // Your code here:
     unsigned long get_time();
@@ -147,6 +164,7 @@ private:
 
 template <typename state_machine, typename command>
 raft<state_machine, command>::raft(rpcs *server, std::vector<rpcc *> clients, int idx, raft_storage<command> *storage, state_machine *state) :
+    rpc_inflight(0),
     stopped(false),
     rpc_server(server),
     rpc_clients(clients),
@@ -158,8 +176,8 @@ raft<state_machine, command>::raft(rpcs *server, std::vector<rpcc *> clients, in
     background_commit(nullptr),
     background_apply(nullptr),
     current_term(0),
-    role(follower) {
-    thread_pool = new ThrPool(32);
+    role(follower),
+    background_reply(nullptr) {
 
     // Register the rpcs.
     rpc_server->reg(raft_rpc_opcodes::op_request_vote, this, &raft::request_vote);
@@ -217,7 +235,9 @@ raft<state_machine, command>::~raft() {
     if (background_apply) {
         delete background_apply;
     }
-    delete thread_pool;
+    if (background_reply) {
+        delete background_reply;
+    }
 }
 
 /******************************************************************
@@ -233,7 +253,12 @@ void raft<state_machine, command>::stop() {
     background_election->join();
     background_commit->join();
     background_apply->join();
-    thread_pool->destroy();
+    {
+        std::unique_lock<std::mutex> lock(rpc_mtx);
+        rpc_done.wait(lock, [this]() { return rpc_inflight == 0; });
+        reply_ready.notify_all();
+    }
+    background_reply->join();
 }
 
 template <typename state_machine, typename command>
@@ -257,6 +282,7 @@ void raft<state_machine, command>::start() {
     this->background_ping = new std::thread(&raft::run_background_ping, this);
     this->background_commit = new std::thread(&raft::run_background_commit, this);
     this->background_apply = new std::thread(&raft::run_background_apply, this);
+    this->background_reply = new std::thread(&raft::run_background_reply, this);
 }
 
 template <typename state_machine, typename command>
@@ -513,34 +539,75 @@ void raft<state_machine, command>::handle_install_snapshot_reply(int node, const
     return;
 }
 
+template <typename state_machine, typename command>
+void raft<state_machine, command>::begin_rpc() {
+    std::unique_lock<std::mutex> lock(rpc_mtx);
+    ++rpc_inflight;
+}
+
+template <typename state_machine, typename command>
+void raft<state_machine, command>::end_rpc() {
+    std::unique_lock<std::mutex> lock(rpc_mtx);
+    if (--rpc_inflight == 0)
+        rpc_done.notify_all();
+}
+
+// Hand a reply to background_reply, which runs handle and then ends the RPC.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::queue_reply(std::function<void()> handle) {
+    std::unique_lock<std::mutex> lock(rpc_mtx);
+    replies.push_back(std::move(handle));
+    reply_ready.notify_one();
+}
+
+// The send_* helpers return at once; the reply is handled when it arrives.
+// They must be called without holding mtx, which the handlers take.
 template <typename state_machine, typename command>
 void raft<state_machine, command>::send_request_vote(int target, request_vote_args arg) {
-    request_vote_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_request_vote, arg, reply) == 0) {
-        handle_request_vote_reply(target, arg, reply);
-    } else {
-        // RPC fails
-    }
+    begin_rpc();
+    rpc_clients[target]->async_call<request_vote_reply>(raft_rpc_opcodes::op_request_vote,
+        [this, target, arg](int ret, request_vote_reply &reply) {
+            if (ret == 0) {
+                queue_reply([this, target, arg, reply]() {
+                    handle_request_vote_reply(target, arg, reply);
+                });
+            } else {
+                // RPC fails
+                end_rpc();
+            }
+        }, arg);
 }
 
 template <typename state_machine, typename command>
 void raft<state_machine, command>::send_append_entries(int target, append_entries_args<command> arg) {
-    append_entries_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_append_entries, arg, reply) == 0) {
-        handle_append_entries_reply(target, arg, reply);
-    } else {
-        // RPC fails
-    }
+    begin_rpc();
+    rpc_clients[target]->async_call<append_entries_reply>(raft_rpc_opcodes::op_append_entries,
+        [this, target, arg](int ret, append_entries_reply &reply) mutable {
+            if (ret == 0) {
+                queue_reply([this, target, arg = std::move(arg), reply]() {
+                    handle_append_entries_reply(target, arg, reply);
+                });
+            } else {
+                // RPC fails
+                end_rpc();
+            }
+        }, arg);
 }
 
 template <typename state_machine, typename command>
 void raft<state_machine, command>::send_install_snapshot(int target, install_snapshot_args arg) {
-    install_snapshot_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_install_snapshot, arg, reply) == 0) {
-        handle_install_snapshot_reply(target, arg, reply);
-    } else {
-        // RPC fails
-    }
+    begin_rpc();
+    rpc_clients[target]->async_call<install_snapshot_reply>(raft_rpc_opcodes::op_install_snapshot,
+        [this, target, arg](int ret, install_snapshot_reply &reply) {
+            if (ret == 0) {
+                queue_reply([this, target, arg, reply]() {
+                    handle_install_snapshot_reply(target, arg, reply);
+                });
+            } else {
+                // RPC fails
+                end_rpc();
+            }
+        }, arg);
 }
 
 /******************************************************************
@@ -561,6 +628,7 @@ void raft<state_machine, command>::run_background_election() {
         // Lab3: Your code here
         mtx.lock();
 
+        std::vector<std::pair<int, request_vote_args>> votes;
         unsigned long random_timeout = get_random_timer();
         if (role != leader && (get_time() - last_rpc_time) > random_timeout) {
             RAFT_LOG("%d has become candidate!", my_id);
@@ -578,10 +646,12 @@ void raft<state_machine, command>::run_background_election() {
                 args.last_log_index = log.size() - 1;
                 args.last_log_term = log[log.size() - 1].term;
                 // RAFT_LOG("vote rpc!");
-                thread_pool->addObjJob(this, &raft::send_request_vote, i, args);
+                votes.push_back(std::make_pair(i, args));
             }
         }
         mtx.unlock();
+        for (auto &v : votes)
+            send_request_vote(v.first, v.second);
         std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }    
     
@@ -598,6 +668,7 @@ void raft<state_machine, command>::run_background_commit() {
         if (is_stopped()) return;
         // Lab3: Your code here
         mtx.lock();
+        std::vector<std::pair<int, append_entries_args<command>>> appends;
         if (role == leader) {
             for (int i = 0; i < rpc_clients.size(); ++i) {
                 if (i == my_id) continue;
@@ -613,11 +684,13 @@ void raft<state_machine, command>::run_background_commit() {
                     for (int j = 0; j < arg.entries_size; ++j) 
                         arg.entries.push_back(log[next_index[i] + j]);
                     // RAFT_LOG("commit rpc!");
-                    thread_pool->addObjJob(this, &raft::send_append_entries, i, arg);
+                    appends.push_back(std::make_pair(i, arg));
                 }
             }
         }
         mtx.unlock();
+        for (auto &a : appends)
+            send_append_entries(a.first, a.second);
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }    
         
@@ -648,6 +721,29 @@ void raft<state_machine, command>::run_background_apply() {
     return;
 }
 
+template <typename state_machine, typename command>
+void raft<state_machine, command>::run_background_reply() {
+    // Handle the RPC replies queued by the send_* helpers, off the RPC
+    // layer's event loop; they take mtx and may persist the log.
+
+    // Work for all the nodes, until stop() has seen the last RPC end.
+
+    std::unique_lock<std::mutex> lock(rpc_mtx);
+    while (true) {
+        reply_ready.wait(lock, [this]() {
+            return !replies.empty() || (is_stopped() && rpc_inflight == 0);
+        });
+        if (replies.empty()) return;
+        std::function<void()> handle = std::move(replies.front());
+        replies.pop_front();
+        lock.unlock();
+        handle();
+        lock.lock();
+        if (--rpc_inflight == 0)
+            rpc_done.notify_all();
+    }
+}
+
 template <typename state_machine, typename command>
 void raft<state_machine, command>::run_background_ping() {
     // Periodly send empty append_entries RPC to the followers.
@@ -660,6 +756,7 @@ void raft<state_machine, command>::run_background_ping() {
         // Lab3: Your code here:
         mtx.lock();
 
+        std::vector<std::pair<int, append_entries_args<command>>> pings;
         if (role == leader) {
             for (int i = 0; i < rpc_clients.size(); ++i) {
                 if (i == my_id) continue;
@@ -672,11 +769,13 @@ void raft<state_machine, command>::run_background_ping() {
                 args.prev_log_index = next_index[i] - 1;
                 args.prev_log_term = log[next_index[i] - 1].term;
                 // RAFT_LOG("Ping RPC");
-                thread_pool->addObjJob(this, &raft::send_append_entries, i, args);
+                pings.push_back(std::make_pair(i, args));
             }
         }
 
         mtx.unlock();
+        for (auto &p : pings)
+            send_append_entries(p.first, p.second);
         std::this_thread::sleep_for(std::chrono::milliseconds(75));
     }    
     
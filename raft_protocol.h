@@ -117,10 +117,10 @@ unmarshall &operator>>(unmarshall &u, append_entries_args<command> &args) {
     u >> args.prev_log_index;
     u >> args.prev_log_term;
     u >> args.entries_size;
-    for (int i = 0; i < args.entries_size; ++i) {
+    for (int i = 0; i < args.entries_size && u.ok(); ++i) {
         log_entry<command> log;
         u >> log;
-        args.entries.push_back(log);
+        args.entries.push_back(std::move(log));
     }
     u >> args.leader_commit;
     u >> args.is_heartbeat;
@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "method_thread.h"
 #include "connection.h"
@@ -15,10 +17,15 @@
 #include "lang/verify.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+// senders wait once this many bytes are queued on a connection
+#define MAX_QUEUED (2*MAX_PDU)
+// byte ranges handed to one writev
+#define MAX_IOV 64
 
 
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), fd_(f1), dead_(false), wq_bytes_(0), wcb_(false),
+  waiters_(0), refno_(1),lossy_(l1)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -29,7 +36,6 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	VERIFY(pthread_mutex_init(&m_,0)==0);
 	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
 	VERIFY(pthread_cond_init(&send_wait_,0)==0);
-	VERIFY(pthread_cond_init(&send_complete_,0)==0);
  
         VERIFY(gettimeofday(&create_time_, NULL) == 0); 
 
@@ -42,10 +48,8 @@ connection::~connection()
 	VERIFY(pthread_mutex_destroy(&m_)== 0);
 	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
 	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
-	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
 	if (rpdu_.buf)
 		free(rpdu_.buf);
-	VERIFY(!wpdu_.buf);
 	close(fd_);
 }
 
@@ -123,18 +127,44 @@ connection::compare(connection *another)
 bool
 connection::send(char *b, int sz)
 {
+	char *copy = (char *)malloc(sz);
+	VERIFY(copy);
+	memcpy(copy, b, sz);
+	int nsz = htonl(sz);
+	bcopy(&nsz, copy, sizeof(nsz));
+	std::shared_ptr<const void> owner(copy, free);
+	return send(rpc_pdu(1, rpc_bytes(owner, copy, sz)));
+}
+
+bool
+connection::send(const rpc_pdu &pdu)
+{
+	outpdu out;
+	out.part = out.solong = 0;
+	int sz = 0;
+	for (size_t i = 0; i < pdu.size(); i++) {
+		// empty ranges would stall writepdus()
+		if (pdu[i].len > 0) {
+			out.parts.push_back(pdu[i]);
+			sz += pdu[i].len;
+		}
+	}
+
 	ScopedLock ml(&m_);
 	waiters_++;
-	while (!dead_ && wpdu_.buf) {
+	while (!dead_ && wq_bytes_ > 0 && wq_bytes_ + sz > MAX_QUEUED) {
 		VERIFY(pthread_cond_wait(&send_wait_, &m_)==0);
 	}
 	waiters_--;
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
-	wpdu_.solong = 0;
+	if (sz == 0) {
+		return true;
+	}
+
+	wq_.push_back(out);
+	wq_bytes_ += sz;
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
@@ -143,27 +173,24 @@ connection::send(char *b, int sz)
 		}
 	}
 
-	if (!writepdu()) {
+	if (wcb_) {
+		// the PollMgr thread is draining the queue and will send this too
+		return true;
+	}
+	if (!writepdus()) {
 		dead_ = true;
 		VERIFY(pthread_mutex_unlock(&m_) == 0);
 		PollMgr::Instance()->block_remove_fd(fd_);
 		VERIFY(pthread_mutex_lock(&m_) == 0);
-	}else{
-		if (wpdu_.solong == wpdu_.sz) {
-		}else{
-			//should be rare to need to explicitly add write callback
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
-			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
-				VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
-			}
-		}
+		if (waiters_ > 0)
+			pthread_cond_broadcast(&send_wait_);
+		return false;
 	}
-	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
-	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
-	if (waiters_ > 0)
-		pthread_cond_broadcast(&send_wait_);
-	return ret;
+	if (!wq_.empty()) {
+		PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+		wcb_ = true;
+	}
+	return true;
 }
 
 //fd_ is ready to be written
@@ -171,22 +198,20 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	VERIFY(!dead_);
 	VERIFY(fd_ == s);
-	if (wpdu_.sz == 0) {
-		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
+	if (dead_) {
 		return;
 	}
-	if (!writepdu()) {
+	if (!writepdus()) {
 		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
 		dead_ = true;
-	}else{
-		VERIFY(wpdu_.solong >= 0);
-		if (wpdu_.solong < wpdu_.sz) {
-			return;
-		}
-	} 
-	pthread_cond_signal(&send_complete_);
+		wcb_ = false;
+	} else if (wq_.empty()) {
+		PollMgr::Instance()->del_callback(fd_, CB_WRONLY);
+		wcb_ = false;
+	}
+	if (waiters_ > 0)
+		pthread_cond_broadcast(&send_wait_);
 }
 
 //fd_ is ready to be read
@@ -207,7 +232,9 @@ connection::read_cb(int s)
 	if (!succ) {
 		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
 		dead_ = true;
-		pthread_cond_signal(&send_complete_);
+		wcb_ = false;
+		if (waiters_ > 0)
+			pthread_cond_broadcast(&send_wait_);
 	}
 
 	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
@@ -219,27 +246,48 @@ connection::read_cb(int s)
 	}
 }
 
+// Write as much of the queue as the socket takes without blocking,
+// several PDUs per writev.  Returns false if the connection failed.
 bool
-connection::writepdu()
+connection::writepdus()
 {
-	VERIFY(wpdu_.solong >= 0);
-	if (wpdu_.solong == wpdu_.sz)
-		return true;
-
-	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
-	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
-	if (n < 0) {
-		if (errno != EAGAIN) {
-			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
-			wpdu_.solong = -1;
-			wpdu_.sz = 0;
+	while (!wq_.empty()) {
+		struct iovec iov[MAX_IOV];
+		int cnt = 0;
+		size_t want = 0;
+		std::deque<outpdu>::iterator it;
+		for (it = wq_.begin(); it != wq_.end() && cnt < MAX_IOV; ++it) {
+			size_t skip = it->solong;
+			for (size_t i = it->part; i < it->parts.size() && cnt < MAX_IOV; i++, cnt++) {
+				iov[cnt].iov_base = (char *)it->parts[i].data + skip;
+				iov[cnt].iov_len = it->parts[i].len - skip;
+				want += iov[cnt].iov_len;
+				skip = 0;
+			}
 		}
-		return (errno == EAGAIN);
+		ssize_t n = writev(fd_, iov, cnt);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				return true;
+			jsl_log(JSL_DBG_1, "connection::writepdus fd_ %d failure errno=%d\n", fd_, errno);
+			return false;
+		}
+		wq_bytes_ -= n;
+		for (size_t left = n; left > 0; ) {
+			outpdu &pdu = wq_.front();
+			size_t rest = pdu.parts[pdu.part].len - pdu.solong;
+			if (left < rest) {
+				pdu.solong += left;
+				break;
+			}
+			left -= rest;
+			pdu.solong = 0;
+			if (++pdu.part == pdu.parts.size())
+				wq_.pop_front();
+		}
+		if ((size_t)n < want)
+			return true;  // the socket is full
 	}
-	wpdu_.solong += n;
 	return true;
 }
 
@@ -7,9 +7,11 @@
 #include <netinet/in.h>
 #include <cstddef>
 
+#include <deque>
 #include <map>
 
 #include "pollmgr.h"
+#include "marshall.h"
 
 class connection;
 
@@ -36,7 +38,13 @@ class connection : public aio_callback {
 		bool isdead();
 		void closeconn();
 
+		// Queue a PDU (sz bytes at b, starting with room for the size)
+		// and return without waiting for it to be written; b may be
+		// reused at once.  False if the connection is dead.
 		bool send(char *b, int sz);
+		// Same for a PDU from marshall::take_pdu(), whose ranges are
+		// queued as they are rather than copied.
+		bool send(const rpc_pdu &pdu);
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -48,13 +56,25 @@ class connection : public aio_callback {
 	private:
 
 		bool readpdu();
-		bool writepdu();
+		bool writepdus();
 
 		chanmgr *mgr_;
 		const int fd_;
 		bool dead_;
 
-		charbuf wpdu_;
+		// PDUs waiting to be written, oldest first; the front one may be
+		// partly written, up to byte solong of its range part.  Whoever
+		// finds the socket idle writes them all with writev; once the
+		// socket is full, the PollMgr thread drains the rest (wcb_ is set
+		// while its write callback is registered).
+		struct outpdu {
+			rpc_pdu parts;
+			size_t part;
+			size_t solong;
+		};
+		std::deque<outpdu> wq_;
+		int wq_bytes_;
+		bool wcb_;
 		charbuf rpdu_;
                 
                 struct timeval create_time_;
@@ -65,7 +85,6 @@ class connection : public aio_callback {
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
-		pthread_cond_t send_complete_;
 		pthread_cond_t send_wait_;
 };
 
@@ -4,8 +4,11 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <memory>
+#include <algorithm>
 #include <stdlib.h>
 #include <string.h>
 #include <cstddef>
@@ -35,6 +38,8 @@ typedef int rpc_sz_t;
 enum {
 	//size of initial buffer allocation 
 	DEFAULT_RPC_SZ = 1024,
+	//rpc_bytes at least this long are referenced by a marshall, not copied
+	MIN_RPC_REF_SZ = 4096,
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
@@ -43,11 +48,43 @@ enum {
 #endif
 };
 
+// A byte range that goes on the wire exactly like a std::string holding
+// it, but that a marshall references instead of copying.  owner keeps
+// data alive for as long as any marshall or queued PDU refers to it.
+struct rpc_bytes {
+	std::shared_ptr<const void> owner;
+	const char *data;
+	size_t len;
+
+	rpc_bytes() : data(NULL), len(0) {}
+	rpc_bytes(std::shared_ptr<const void> o, const char *d, size_t n)
+		: owner(o), data(d), len(n) {}
+	explicit rpc_bytes(const std::shared_ptr<const std::string> &s)
+		: owner(s), data(s->data()), len(s->size()) {}
+
+	// bytes [off, off + n) of this range, cut short at its end
+	rpc_bytes slice(size_t off, size_t n) const {
+		off = std::min(off, len);
+		return rpc_bytes(owner, data + off, std::min(n, len - off));
+	}
+};
+
+// A PDU ready to send, as a list of byte ranges to be written in order.
+typedef std::vector<rpc_bytes> rpc_pdu;
+
+// Marshalled data is kept in one buffer, except that ranges added with
+// ref() stay where they are and are spliced in when the PDU is taken
+// with take_pdu(), or when the contiguous bytes are asked for.
 class marshall {
 	private:
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		// Referenced ranges, each with the buffer offset it follows
+		std::vector<std::pair<int, rpc_bytes> > _refs;
+		int _reflen;    // Total length of the referenced ranges
+
+		void flatten();
 
 	public:
 		marshall() {
@@ -55,6 +92,7 @@ class marshall {
 			VERIFY(_buf);
 			_capa = DEFAULT_RPC_SZ;
 			_ind = RPC_HEADER_SZ;
+			_reflen = 0;
 		}
 
 		~marshall() { 
@@ -62,14 +100,20 @@ class marshall {
 				free(_buf); 
 		}
 
-		int size() { return _ind;}
-		char *cstr() { return _buf;}
+		int size() { return _ind + _reflen;}
+		char *cstr() { flatten(); return _buf;}
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		// Make room for n bytes at the write head and return a pointer
+		// to them, so a large payload can be produced in place.
+		char *reserve(int n);
+		// Append b's bytes without copying them.
+		void ref(const rpc_bytes &b);
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
+			flatten();
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
 		}
 
@@ -108,12 +152,17 @@ class marshall {
 		}
 
 		void take_buf(char **b, int *s) {
+			flatten();
 			*b = _buf;
 			*s = _ind;
 			_buf = NULL;
 			_ind = 0;
 			return;
 		}
+
+		// Fill in the PDU size and hand the buffer and the referenced
+		// ranges over as a PDU; like take_buf(), this empties the marshall.
+		rpc_pdu take_pdu();
 };
 marshall& operator<<(marshall &, bool);
 marshall& operator<<(marshall &, unsigned int);
@@ -124,6 +173,7 @@ marshall& operator<<(marshall &, unsigned short);
 marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
+marshall& operator<<(marshall &, const rpc_bytes &);
 
 class unmarshall {
 	private:
@@ -161,6 +211,8 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		// Point v at the next n bytes, which stay in this unmarshall's buffer
+		void rawview(std::string_view &v, unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
@@ -207,9 +259,12 @@ unmarshall& operator>>(unmarshall &, unsigned int &);
 unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
+// Zero-copy: valid only as long as the unmarshall (for an RPC handler
+// argument, until the handler returns).
+unmarshall& operator>>(unmarshall &, std::string_view &);
 
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
@@ -222,10 +277,12 @@ operator>>(unmarshall &u, std::vector<C> &v)
 {
 	unsigned n;
 	u >> n;
+	if (u.ok())
+		v.reserve(v.size() + std::min<size_t>(n, u.size() - u.ind()));
 	for(unsigned i = 0; i < n; i++){
 		C z;
 		u >> z;
-		v.push_back(z);
+		v.push_back(std::move(z));
 	}
 	return u;
 }
@@ -0,0 +1,103 @@
+#ifndef mpmc_h
+#define mpmc_h
+
+// mpmc template
+// a bounded multi-producer multi-consumer queue that takes no locks:
+// enq() and deq() never block, they fail when the queue is FULL or EMPTY.
+// Every slot carries a sequence number saying whose turn it is, so a
+// producer and a consumer only ever contend on one atomic counter each
+// (D. Vyukov's bounded MPMC queue).
+
+#include <atomic>
+#include <stddef.h>
+
+#define MPMC_CACHE_LINE 64
+
+template<class T>
+class mpmc {
+	public:
+		mpmc(size_t m);
+		~mpmc();
+		bool enq(const T &e);
+		bool deq(T *e);
+		size_t capacity() { return mask_ + 1; }
+	private:
+		struct cell {
+			std::atomic<size_t> seq;
+			T data;
+		};
+		cell *cells_;
+		size_t mask_;
+		alignas(MPMC_CACHE_LINE) std::atomic<size_t> head_; // next to enq
+		alignas(MPMC_CACHE_LINE) std::atomic<size_t> tail_; // next to deq
+};
+
+// the capacity is m rounded up to a power of two
+template<class T>
+mpmc<T>::mpmc(size_t m) : head_(0), tail_(0)
+{
+	size_t n = 2;
+	while (n < m)
+		n <<= 1;
+	cells_ = new cell[n];
+	mask_ = n - 1;
+	for (size_t i = 0; i < n; i++)
+		cells_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template<class T>
+mpmc<T>::~mpmc()
+{
+	//to be deleted only when no threads are using it!
+	delete[] cells_;
+}
+
+template<class T> bool
+mpmc<T>::enq(const T &e)
+{
+	cell *c;
+	size_t pos = head_.load(std::memory_order_relaxed);
+	while (1) {
+		c = &cells_[pos & mask_];
+		size_t seq = c->seq.load(std::memory_order_acquire);
+		ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)pos;
+		if (dif == 0) {
+			if (head_.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return false; // full
+		} else {
+			pos = head_.load(std::memory_order_relaxed);
+		}
+	}
+	c->data = e;
+	c->seq.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+template<class T> bool
+mpmc<T>::deq(T *e)
+{
+	cell *c;
+	size_t pos = tail_.load(std::memory_order_relaxed);
+	while (1) {
+		c = &cells_[pos & mask_];
+		size_t seq = c->seq.load(std::memory_order_acquire);
+		ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+		if (dif == 0) {
+			if (tail_.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return false; // empty
+		} else {
+			pos = tail_.load(std::memory_order_relaxed);
+		}
+	}
+	*e = c->data;
+	c->seq.store(pos + mask_ + 1, std::memory_order_release);
+	return true;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 
 #include "slock.h"
 #include "jsl_log.h"
@@ -25,25 +26,74 @@ PollMgr::Instance()
 	return instance;
 }
 
-PollMgr::PollMgr() : pending_change_(false)
+PollMgr::PollMgr()
+{
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	char *env = getenv("RPC_POLL_THREADS");
+	if (env != NULL)
+		n = atoi(env);
+	if (n < 1)
+		n = 1;
+	if (n > MAX_POLL_THREADS)
+		n = MAX_POLL_THREADS;
+	jsl_log(JSL_DBG_1, "PollMgr: %d poll threads\n", n);
+	for (int i = 0; i < n; i++)
+		loops_.push_back(new PollLoop());
+}
+
+PollMgr::~PollMgr()
+{
+	//never kill me!!!
+	VERIFY(0);
+}
+
+void
+PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
+{
+	VERIFY(fd >= 0 && fd < MAX_POLL_FDS);
+	loop(fd)->add_callback(fd, flag, ch);
+}
+
+void
+PollMgr::block_remove_fd(int fd)
+{
+	loop(fd)->block_remove_fd(fd);
+}
+
+void
+PollMgr::del_callback(int fd, poll_flag flag)
+{
+	loop(fd)->del_callback(fd, flag);
+}
+
+bool
+PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
+{
+	return loop(fd)->has_callback(fd, flag, c);
+}
+
+PollLoop::PollLoop() : pending_change_(false)
 {
 	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
+#ifdef __linux__
+	aio_ = new EPollAIO();
+#else
 	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+#endif
 
 	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
-	VERIFY((th_ = method_thread(this, false, &PollMgr::wait_loop)) != 0);
+	VERIFY((th_ = method_thread(this, false, &PollLoop::wait_loop)) != 0);
 }
 
-PollMgr::~PollMgr()
+PollLoop::~PollLoop()
 {
 	//never kill me!!!
 	VERIFY(0);
 }
 
 void
-PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
+PollLoop::add_callback(int fd, poll_flag flag, aio_callback *ch)
 {
 	VERIFY(fd < MAX_POLL_FDS);
 
@@ -58,7 +108,7 @@ PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
 //the return guarantees that callbacks related to fd
 //will never be called again
 void
-PollMgr::block_remove_fd(int fd)
+PollLoop::block_remove_fd(int fd)
 {
 	ScopedLock ml(&m_);
 	aio_->unwatch_fd(fd, CB_RDWR);
@@ -68,7 +118,7 @@ PollMgr::block_remove_fd(int fd)
 }
 
 void
-PollMgr::del_callback(int fd, poll_flag flag)
+PollLoop::del_callback(int fd, poll_flag flag)
 {
 	ScopedLock ml(&m_);
 	if (aio_->unwatch_fd(fd, flag)) {
@@ -77,7 +127,7 @@ PollMgr::del_callback(int fd, poll_flag flag)
 }
 
 bool
-PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
+PollLoop::has_callback(int fd, poll_flag flag, aio_callback *c)
 {
 	ScopedLock ml(&m_);
 	if (!callbacks_[fd] || callbacks_[fd]!=c)
@@ -87,7 +137,7 @@ PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
 }
 
 void
-PollMgr::wait_loop()
+PollLoop::wait_loop()
 {
 
 	std::vector<int> readable;
@@ -263,96 +313,123 @@ EPollAIO::EPollAIO()
 	pollfd_ = epoll_create(MAX_POLL_FDS);
 	VERIFY(pollfd_ >= 0);
 	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	// written to wake up wait_ready() when an fd is removed
+	VERIFY(pipe(pipefd_) == 0);
+	int flags = fcntl(pipefd_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipefd_[0], F_SETFL, flags);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = pipefd_[0];
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
+
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
 	close(pollfd_);
+	close(pipefd_[0]);
+	close(pipefd_[1]);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
 }
 
-static inline
-int poll_flag_to_event(poll_flag flag)
-{
-	int f;
-	if (flag == CB_RDONLY) {
-		f = EPOLLIN;
-	}else if (flag == CB_WRONLY) {
-		f = EPOLLOUT;
-	}else { //flag == CB_RDWR
-		f = EPOLLIN | EPOLLOUT;
-	}
-	return f;
-}
-
+// Make the epoll set agree with fdstatus_[fd], which was old.
 void
-EPollAIO::watch_fd(int fd, poll_flag flag)
+EPollAIO::update(int fd, int old)
 {
-	VERIFY(fd < MAX_POLL_FDS);
+	int now = fdstatus_[fd];
+	if (now == old)
+		return;
 
 	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-	fdstatus_[fd] |= (int)flag;
-
-	ev.events = EPOLLET;
+	ev.events = 0;
 	ev.data.fd = fd;
-
-	if (fdstatus_[fd] & CB_RDONLY) {
+	if (now & CB_RDONLY) {
 		ev.events |= EPOLLIN;
 	}
-	if (fdstatus_[fd] & CB_WRONLY) {
+	if (now & CB_WRONLY) {
 		ev.events |= EPOLLOUT;
 	}
 
-	if (flag == CB_RDWR) {
-		VERIFY(ev.events == (uint32_t)(EPOLLET | EPOLLIN | EPOLLOUT));
+	int op = !old ? EPOLL_CTL_ADD : (!now ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+	if (epoll_ctl(pollfd_, op, fd, &ev) != 0) {
+		// the fd may already have been closed, which removes it
+		VERIFY(op == EPOLL_CTL_DEL);
 	}
+}
 
-	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
+void
+EPollAIO::watch_fd(int fd, poll_flag flag)
+{
+	VERIFY(fd < MAX_POLL_FDS);
+
+	ScopedLock ml(&m_);
+	int old = fdstatus_[fd];
+	fdstatus_[fd] |= (int)flag;
+	update(fd, old);
 }
 
 bool 
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	fdstatus_[fd] &= ~(int)flag;
+	VERIFY(flag == CB_RDONLY || flag == CB_WRONLY || flag == CB_RDWR);
 
-	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-
-	ev.events = EPOLLET;
-	ev.data.fd = fd;
-
-	if (fdstatus_[fd] & CB_RDONLY) {
-		ev.events |= EPOLLIN;
-	}
-	if (fdstatus_[fd] & CB_WRONLY) {
-		ev.events |= EPOLLOUT;
-	}
+	ScopedLock ml(&m_);
+	int old = fdstatus_[fd];
+	fdstatus_[fd] &= ~(int)flag;
+	update(fd, old);
 
 	if (flag == CB_RDWR) {
-		VERIFY(op == EPOLL_CTL_DEL);
+		char tmp = 1;
+		VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
 	}
-	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
-	return (op == EPOLL_CTL_DEL);
+	return !fdstatus_[fd];
 }
 
 bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	ScopedLock ml(&m_);
+	return ((fdstatus_[fd] & flag) == flag);
 }
 
 void
 EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 {
-	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	int nfds = epoll_wait(pollfd_, ready_, MAX_POLL_FDS, -1);
+	if (nfds < 0) {
+		if (errno == EINTR) {
+			return;
+		} else {
+			perror("epoll_wait:");
+			jsl_log(JSL_DBG_OFF, "PollMgr::epoll_loop failure errno %d\n",errno);
+			VERIFY(0);
+		}
+	}
+
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
-			readable->push_back(ready_[i].data.fd);
+		int fd = ready_[i].data.fd;
+		if (fd == pipefd_[0]) {
+			char tmp[64];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+			continue;
+		}
+		// errors and hangups are reported as readable, so that the
+		// read callback notices the failure
+		uint32_t ev = ready_[i].events;
+		if (ev & (EPOLLERR | EPOLLHUP))
+			ev |= EPOLLIN;
+		if (ev & EPOLLOUT) {
+			writable->push_back(fd);
 		}
-		if (ready_[i].events & EPOLLOUT) {
-			writable->push_back(ready_[i].data.fd);
+		if (ev & EPOLLIN) {
+			readable->push_back(fd);
 		}
 	}
 }
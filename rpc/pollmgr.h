@@ -2,6 +2,7 @@
 #define pollmgr_h 
 
 #include <sys/select.h>
+#include <pthread.h>
 #include <vector>
 
 #ifdef __linux__
@@ -9,6 +10,7 @@
 #endif
 
 #define MAX_POLL_FDS 2048
+#define MAX_POLL_THREADS 8
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -34,6 +36,34 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
+// One event loop: a thread waiting on an aio_mgr and running the
+// callbacks of the fds it watches.
+class PollLoop {
+	public:
+		PollLoop();
+		~PollLoop();
+
+		void add_callback(int fd, poll_flag flag, aio_callback *ch);
+		void del_callback(int fd, poll_flag flag);
+		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
+		void block_remove_fd(int fd);
+		void wait_loop();
+
+	private:
+		pthread_mutex_t m_;
+		pthread_cond_t changedone_c_;
+		pthread_t th_;
+
+		aio_callback *callbacks_[MAX_POLL_FDS];
+		aio_mgr *aio_;
+		bool pending_change_;
+
+};
+
+// PollMgr runs several PollLoops (RPC_POLL_THREADS of them, by default
+// one per core up to MAX_POLL_THREADS) and gives each fd to the loop
+// fd % nloops, so the callbacks of one fd always run on the same thread
+// while different connections are served in parallel.
 class PollMgr {
 	public:
 		PollMgr();
@@ -46,7 +76,6 @@ class PollMgr {
 		void del_callback(int fd, poll_flag flag);
 		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
 		void block_remove_fd(int fd);
-		void wait_loop();
 
 
 		static PollMgr *instance;
@@ -54,13 +83,8 @@ class PollMgr {
 		static int useless;
 
 	private:
-		pthread_mutex_t m_;
-		pthread_cond_t changedone_c_;
-		pthread_t th_;
-
-		aio_callback *callbacks_[MAX_POLL_FDS];
-		aio_mgr *aio_;
-		bool pending_change_;
+		std::vector<PollLoop *> loops_;
+		PollLoop *loop(int fd) { return loops_[fd % loops_.size()]; }
 
 };
 
@@ -86,6 +110,7 @@ class SelectAIO : public aio_mgr {
 };
 
 #ifdef __linux__ 
+// Level-triggered, like select: a callback need not drain its fd.
 class EPollAIO : public aio_mgr {
 	public:
 		EPollAIO();
@@ -96,12 +121,16 @@ class EPollAIO : public aio_mgr {
 		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
 
 	private:
+		void update(int fd, int old);
+
 		int pollfd_;
+		int pipefd_[2];
 		struct epoll_event ready_[MAX_POLL_FDS];
 		int fdstatus_[MAX_POLL_FDS];
 
+		pthread_mutex_t m_;
+
 };
 #endif /* __linux */
 
 #endif /* pollmgr_h */
-
@@ -11,17 +11,24 @@
 
  Both rpcc and rpcs use the connection class as an abstraction for the
  underlying communication channel.  To send an RPC request/reply, one calls
- connection::send() which blocks until data is sent or the connection has failed
- (thus the caller can free the buffer when send() returns).  When a
+ connection::send() which queues a copy of the data and returns (thus the
+ caller can free the buffer when send() returns); queued PDUs are written
+ in batches with writev, by the sender if the socket is idle and otherwise
+ by a PollMgr thread once the socket is writable.  When a
  request/reply is received, connection makes a callback into the corresponding
  rpcc or rpcs (see rpcc::got_pdu() and rpcs::got_pdu()).
 
  Thread organization:
  rpcc uses application threads to send RPC requests and blocks to receive the
- reply or error. All connections use a single PollMgr object to perform async
- socket IO.  PollMgr creates a single thread to examine the readiness of socket
- file descriptors and informs the corresponding connection whenever a socket is
- ready to be read or written.  (We use asynchronous socket IO to reduce the
+ reply or error.  rpcc::async_call1() instead returns once the request is sent
+ and completes the call from got_pdu(); a per-rpcc timer thread, started by
+ the first async call, retransmits and times out async calls, so one thread
+ can keep any number of RPCs in flight.  All connections use a single PollMgr
+ object to perform async socket IO.  PollMgr runs a few event loops, each
+ a thread with its own epoll set, and spreads the sockets over them by file
+ descriptor; a loop examines the readiness of its sockets and informs the
+ corresponding connection whenever a socket is ready to be read or written.
+ All callbacks of one connection run on the same loop thread.  (We use asynchronous socket IO to reduce the
  number of threads needed to manage these connections; without async IO, at
  least one thread is needed per connection to read data without blocking other
  activities.)  Each rpcs object creates one thread for listening on the server
@@ -76,9 +83,10 @@
 
 const rpcc::TO rpcc::to_max = { 10000 };
 const rpcc::TO rpcc::to_min = { 1000 };
+const rpcc::TO rpcc::to_poll = { 100 };
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-: xid(xxid), un(xun), done(false)
+: xid(xxid), un(xun), done(false), ch(NULL), curr_to(0)
 {
 	VERIFY(pthread_mutex_init(&m,0) == 0);
 	VERIFY(pthread_cond_init(&c, 0) == 0);
@@ -100,11 +108,13 @@ void set_rand_seed()
 
 rpcc::rpcc(sockaddr_in d, bool retrans) : 
 	_count(0), dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0), 
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false),
+	timer_started_(false), timer_stop_(false), xid_rep_done_(-1)
 {
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
 	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&timer_c_, 0) == 0);
 
 	if(retrans){
 		set_rand_seed();
@@ -134,6 +144,28 @@ rpcc::~rpcc()
 {
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n", 
 			clt_nonce_, chan_?chan_->channo():-1); 
+	if(timer_started_){
+		{
+			ScopedLock ml(&m_);
+			timer_stop_ = true;
+			VERIFY(pthread_cond_signal(&timer_c_) == 0);
+		}
+		VERIFY(pthread_join(timer_th_, NULL) == 0);
+	}
+	// async calls still outstanding fail, as they would on cancel()
+	std::vector<caller *> pending;
+	std::map<int,caller*>::iterator it;
+	for(it = calls_.begin(); it != calls_.end(); ){
+		if(it->second->cb){
+			pending.push_back(it->second);
+			calls_.erase(it++);
+		} else {
+			it++;
+		}
+	}
+	unmarshall none;
+	for(size_t i = 0; i < pending.size(); i++)
+		finish_async(pending[i], rpc_const::cancel_failure, none);
 	if(chan_){
 		chan_->closeconn();
 		chan_->decref();
@@ -141,6 +173,7 @@ rpcc::~rpcc()
 	VERIFY(calls_.size() == 0);
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
 	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_cond_destroy(&timer_c_) == 0);
 }
 
 int
@@ -163,9 +196,25 @@ rpcc::bind(TO to)
 void
 rpcc::cancel(void)
 {
+  std::vector<caller *> pending;
+  std::map<int,caller*>::iterator it;
+  {
+    ScopedLock ml(&m_);
+    for(it = calls_.begin(); it != calls_.end(); ){
+      if(it->second->cb){
+        pending.push_back(it->second);
+        calls_.erase(it++);
+      } else {
+        it++;
+      }
+    }
+  }
+  unmarshall none;
+  for(size_t i = 0; i < pending.size(); i++)
+    finish_async(pending[i], rpc_const::cancel_failure, none);
+
   ScopedLock ml(&m_);
   jsl_log(JSL_DBG_2, "rpcc::cancel: force callers to fail\n");
-  std::map<int,caller*>::iterator it;
   for(it = calls_.begin(); it != calls_.end(); it++){
     caller *ca = it->second;
 
@@ -214,15 +263,17 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		req.pack_req_header(h);
                 xid_rep = xid_rep_window_.front();
 	}
+	rpc_pdu pdu = req.take_pdu();
 
 	TO curr_to;
-	struct timespec now, nextdeadline, finaldeadline; 
+	struct timespec now, nextdeadline, finaldeadline, slice; 
 
 	clock_gettime(CLOCK_REALTIME, &now);
 	add_timespec(now, to.to, &finaldeadline); 
 	curr_to.to = to_min.to;
 
 	bool transmit = true;
+	bool newround = true;
 	connection *ch = NULL;
 
 	while (1){
@@ -239,8 +290,8 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
                                                 }
                                         }
                                         if (forgot.isvalid()) 
-                                                ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
-                                        ch->send(req.cstr(), req.size());
+                                                ch->send(forgot.buf);
+                                        ch->send(pdu);
                                 }
 				else jsl_log(JSL_DBG_1, "not reachable\n");
 				jsl_log(JSL_DBG_2, 
@@ -250,23 +301,33 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 			transmit = false; // only send once on a given channel
 		}
 
-		if(!finaldeadline.tv_sec)
-			break;
-
 		clock_gettime(CLOCK_REALTIME, &now);
-		add_timespec(now, curr_to.to, &nextdeadline); 
-		if(cmp_timespec(nextdeadline,finaldeadline) > 0){
-			nextdeadline = finaldeadline;
-			finaldeadline.tv_sec = 0;
+		if(newround){
+			if(!finaldeadline.tv_sec)
+				break;
+
+			add_timespec(now, curr_to.to, &nextdeadline); 
+			if(cmp_timespec(nextdeadline,finaldeadline) > 0){
+				nextdeadline = finaldeadline;
+				finaldeadline.tv_sec = 0;
+			}
+			newround = false;
 		}
 
+		// wait in slices of to_poll, so that a request lost with its
+		// connection is resent right away rather than at the end of
+		// the round; under loss connections can die much faster than
+		// the timeout grows
+		add_timespec(now, to_poll.to, &slice);
+		if(cmp_timespec(slice, nextdeadline) > 0)
+			slice = nextdeadline;
+
 		{
 			ScopedLock cal(&ca.m);
 			while (!ca.done){
 			        jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
 				if(pthread_cond_timedwait(&ca.c, &ca.m,
-                                                 &nextdeadline) == ETIMEDOUT){
-				  	jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
+                                                 &slice) == ETIMEDOUT){
 					break;
 				}
 			}
@@ -276,6 +337,14 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 			}
 		}
 
+		if(cmp_timespec(slice, nextdeadline) < 0){
+			if(retrans_ && ch && ch->isdead())
+				transmit = true;
+			continue;
+		}
+		jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
+		newround = true;
+
 		if(retrans_ && (!ch || ch->isdead())){
 			// since connection is dead, retransmit
                         // on the new connection 
@@ -302,7 +371,7 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
         {
                 ScopedLock ml(&m_);
                 if (!dup_req_.isvalid()) {
-                        dup_req_.buf.assign(req.cstr(), req.size());
+                        dup_req_.buf = pdu;
                         dup_req_.xid = ca.xid;
                 }
                 if (xid_rep > xid_rep_done_)
@@ -326,6 +395,185 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 	return (ca.done? ca.intret : rpc_const::timeout_failure);
 }
 
+void
+rpcc::async_call1(unsigned int proc, marshall &req, reply_cb cb, TO to)
+{
+	unmarshall none;
+	if (!reachable_) {
+		cb(rpc_const::unreachable_failure, none);
+		return;
+	}
+
+	caller *ca = new caller(0, NULL);
+	ca->cb = cb;
+	unsigned int xid;
+	rpc_pdu pdu;
+	int err = 0;
+	{
+		ScopedLock ml(&m_);
+
+		if((proc != rpc_const::bind && !bind_done_) ||
+				(proc == rpc_const::bind && bind_done_)){
+			jsl_log(JSL_DBG_1, "rpcc::async_call1 rpcc has not been bound to dst or binding twice\n");
+			err = rpc_const::bind_failure;
+		} else if(destroy_wait_){
+			err = rpc_const::cancel_failure;
+		} else {
+			xid = ca->xid = xid_++;
+			calls_[ca->xid] = ca;
+
+			req_header h(ca->xid, proc, clt_nonce_, srv_nonce_,
+			             xid_rep_window_.front());
+			req.pack_req_header(h);
+			ca->req = pdu = req.take_pdu();
+
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			add_timespec(now, to.to, &ca->finaldeadline);
+			ca->curr_to = to_min.to;
+			add_timespec(now, ca->curr_to, &ca->nextdeadline);
+			if(cmp_timespec(ca->nextdeadline, ca->finaldeadline) > 0)
+				ca->nextdeadline = ca->finaldeadline;
+
+			if(!timer_started_){
+				timer_th_ = method_thread(this, false, &rpcc::async_timer);
+				timer_started_ = true;
+			}
+			VERIFY(pthread_cond_signal(&timer_c_) == 0);
+		}
+	}
+	if(err){
+		finish_async(ca, err, none);
+		return;
+	}
+
+	connection *ch = NULL;
+	get_refconn(&ch);
+	if(ch){
+		if(reachable_)
+			ch->send(pdu);
+		else
+			jsl_log(JSL_DBG_1, "not reachable\n");
+		jsl_log(JSL_DBG_2,
+				"rpcc::async_call1 %u just sent req proc %x xid %u\n",
+				clt_nonce_, proc, xid);
+		// the reply may already have completed the call
+		ScopedLock ml(&m_);
+		std::map<int,caller*>::iterator it = calls_.find(xid);
+		if(it != calls_.end() && !it->second->ch){
+			it->second->ch = ch;
+			ch = NULL;
+		}
+	}
+	if(ch)
+		ch->decref();
+}
+
+// Complete an async call that has already been removed from calls_.
+// Called without m_ held.
+void
+rpcc::finish_async(caller *ca, int ret, unmarshall &rep)
+{
+	jsl_log(JSL_DBG_2, "rpcc::finish_async %u xid %u ret %d\n",
+			clt_nonce_, ca->xid, ret);
+	ca->cb(ret, rep);
+	if(ca->ch)
+		ca->ch->decref();
+	delete ca;
+}
+
+// The timer thread does for async calls what call1() does for its own
+// call while it waits: resend on a new connection if the old one died
+// and fail the call once its final deadline has passed.
+void
+rpcc::async_timer()
+{
+	ScopedLock ml(&m_);
+	while(!timer_stop_){
+		struct timespec now, wake;
+		clock_gettime(CLOCK_REALTIME, &now);
+		add_timespec(now, to_max.to, &wake);
+
+		std::vector<caller *> expired;
+		// xid, request and a reference to the connection it was sent on
+		struct retry {
+			unsigned int xid;
+			rpc_pdu req;
+			connection *ch;
+		};
+		std::vector<retry> retries;
+
+		std::map<int,caller*>::iterator it;
+		for(it = calls_.begin(); it != calls_.end(); ){
+			caller *ca = it->second;
+			if(!ca->cb){
+				it++;
+				continue;
+			}
+			if(cmp_timespec(ca->finaldeadline, now) <= 0){
+				update_xid_rep(ca->xid);
+				expired.push_back(ca);
+				calls_.erase(it++);
+				continue;
+			}
+			if(cmp_timespec(ca->nextdeadline, now) <= 0){
+				if(retrans_){
+					retry r = { ca->xid, ca->req, ca->ch };
+					if(r.ch)
+						r.ch->incref();
+					retries.push_back(r);
+				}
+				ca->curr_to <<= 1;
+				add_timespec(now, ca->curr_to, &ca->nextdeadline);
+				if(cmp_timespec(ca->nextdeadline, ca->finaldeadline) > 0)
+					ca->nextdeadline = ca->finaldeadline;
+			}
+			if(cmp_timespec(ca->nextdeadline, wake) < 0)
+				wake = ca->nextdeadline;
+			it++;
+		}
+
+		if(expired.empty() && retries.empty()){
+			pthread_cond_timedwait(&timer_c_, &m_, &wake);
+			continue;
+		}
+		if(!expired.empty() && destroy_wait_)
+			VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
+
+		// connections take their own lock before m_ (see got_pdu), so
+		// look at them and send with m_ released
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		unmarshall none;
+		for(size_t i = 0; i < expired.size(); i++){
+			jsl_log(JSL_DBG_2, "rpcc::async_timer: timeout xid %u\n",
+					expired[i]->xid);
+			finish_async(expired[i], rpc_const::timeout_failure, none);
+		}
+		for(size_t i = 0; i < retries.size(); i++){
+			connection *old = retries[i].ch, *ch = NULL;
+			bool dead = !old || old->isdead();
+			if(old)
+				old->decref();
+			if(!dead)
+				continue;
+			get_refconn(&ch);
+			if(!ch)
+				continue;
+			if(reachable_)
+				ch->send(retries[i].req);
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			it = calls_.find(retries[i].xid);
+			if(it != calls_.end()){
+				std::swap(it->second->ch, ch);
+			}
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			if(ch)
+				ch->decref();
+		}
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+	}
+}
+
 void
 rpcc::get_refconn(connection **ch)
 {
@@ -344,7 +592,7 @@ rpcc::get_refconn(connection **ch)
 	}
 }
 
-// PollMgr's thread is being used to 
+// a PollMgr thread is being used to 
 // make this upcall from connection object to rpcc. 
 // this funtion must not block.
 //
@@ -361,27 +609,39 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 		return true;
 	}
 
-	ScopedLock ml(&m_);
+	caller *ca;
+	{
+		ScopedLock ml(&m_);
 
-	update_xid_rep(h.xid);
+		update_xid_rep(h.xid);
 
-	if(calls_.find(h.xid) == calls_.end()){
-		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
-		return true;
-	}
-	caller *ca = calls_[h.xid];
-
-	ScopedLock cl(&ca->m);
-	if(!ca->done){
-		ca->un->take_in(rep);
-		ca->intret = h.ret;
-		if(ca->intret < 0){
-			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
-					h.xid, ca->intret);
+		if(calls_.find(h.xid) == calls_.end()){
+			jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
+			return true;
+		}
+		ca = calls_[h.xid];
+		if(ca->cb){
+			calls_.erase(h.xid);
+			if(destroy_wait_){
+				VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
+			}
+		} else {
+			ScopedLock cl(&ca->m);
+			if(!ca->done){
+				ca->un->take_in(rep);
+				ca->intret = h.ret;
+				if(ca->intret < 0){
+					jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+							h.xid, ca->intret);
+				}
+				ca->done = 1;
+			}
+			VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+			return true;
 		}
-		ca->done = 1;
 	}
-	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+	// an async call completes here, on a PollMgr thread
+	finish_async(ca, h.ret, rep);
 	return true;
 }
 
@@ -589,8 +849,7 @@ rpcs::dispatch(djob_t *j)
 	}
 
 	rpcs::rpcstate_t stat;
-	char *b1;
-	int sz1;
+	rpc_pdu b1;
 
 	if(h.clt_nonce){
 		// have i seen this client before?
@@ -619,7 +878,7 @@ rpcs::dispatch(djob_t *j)
 		}
 
 		stat = checkduplicate_and_update(h.clt_nonce, h.xid,
-                                                 h.xid_rep, &b1, &sz1);
+                                                 h.xid_rep, &b1);
 	} else {
 		// this client does not require at most once logic
 		stat = NEW;
@@ -642,15 +901,14 @@ rpcs::dispatch(djob_t *j)
 			VERIFY(rh.ret >= 0);
 
 			rep.pack_reply_header(rh);
-			rep.take_buf(&b1,&sz1);
-			
 			jsl_log(JSL_DBG_2,
 					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-					sz1, h.xid, proc, rh.ret, h.clt_nonce);
+					rep.size(), h.xid, proc, rh.ret, h.clt_nonce);
+			b1 = rep.take_pdu();
 
 			if(h.clt_nonce > 0){
 				// only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
+				add_reply(h.clt_nonce, h.xid, b1);
 			}
 
 			// get the latest connection to the client
@@ -663,16 +921,12 @@ rpcs::dispatch(djob_t *j)
 				}
 			}
 
-			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
-				// reply is not added to at-most-once window, free it
-				free(b1);
-			}
+			c->send(b1);
 			break;
 		case INPROGRESS: // server is working on this request
 			break;
 		case DONE: // duplicate and we still have the response
-			c->send(b1, sz1);
+			c->send(b1);
 			break;
 		case FORGOTTEN: // very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n", 
@@ -701,7 +955,7 @@ rpcs::dispatch(djob_t *j)
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
 rpcs::rpcstate_t 
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
-                                unsigned int xid_rep, char **b, int *sz)
+                                unsigned int xid_rep, rpc_pdu *b)
 {
 	
     ScopedLock rwl(&reply_window_m_);
@@ -710,13 +964,12 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
     std::list<reply_t>::iterator it = reply_window_[clt_nonce].begin();
 	for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
 	{
-		reply_t reply = *it;
+		reply_t &reply = *it;
 		if (reply.xid == xid)
 		{
 			if (reply.cb_present)
 			{
 				*b = reply.buf;
-				*sz = reply.sz;
 				return DONE;
 			}
 			return INPROGRESS;
@@ -764,18 +1017,16 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 // free_reply_window() and checkduplicate_and_update is responsible for 
 // calling free(b).
 void
-rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz)
+rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, const rpc_pdu &b)
 {
     ScopedLock rwl(&reply_window_m_);
 
     // Your lab7 code goes here
 	for(std::list<reply_t>::iterator it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++)
 	{
-		reply_t reply = *it;
-		if(reply.xid == xid)
+		if(it->xid == xid)
 		{
 			it->buf = b;
-			it->sz = sz;
 			it->cb_present = true;
 			break;
 		}
@@ -786,13 +1037,9 @@ void
 rpcs::free_reply_window(void)
 {
 	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
 
 	ScopedLock rwl(&reply_window_m_);
 	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
-		}
 		clt->second.clear();
 	}
 	reply_window_.clear();
@@ -821,6 +1068,12 @@ marshall::rawbyte(unsigned char x)
 
 void
 marshall::rawbytes(const char *p, int n)
+{
+	memcpy(reserve(n), p, n);
+}
+
+char *
+marshall::reserve(int n)
 {
 	if((_ind+n) > _capa){
 		_capa = _capa > n? 2*_capa:(_capa+n);
@@ -828,8 +1081,70 @@ marshall::rawbytes(const char *p, int n)
 		_buf = (char *)realloc(_buf, _capa);
 		VERIFY(_buf);
 	}
-	memcpy(_buf+_ind, p, n);
+	char *p = _buf+_ind;
 	_ind += n;
+	return p;
+}
+
+void
+marshall::ref(const rpc_bytes &b)
+{
+	if(b.len == 0)
+		return;
+	_refs.push_back(std::make_pair(_ind, b));
+	_reflen += b.len;
+}
+
+// Copy the referenced ranges into the buffer, in place.
+void
+marshall::flatten()
+{
+	if(_refs.empty())
+		return;
+	int total = _ind + _reflen;
+	int capa = total > _capa ? total : _capa;
+	char *nb = (char *)malloc(capa);
+	VERIFY(nb);
+	int from = 0, to = 0;
+	for(size_t i = 0; i < _refs.size(); i++){
+		int at = _refs[i].first;
+		const rpc_bytes &b = _refs[i].second;
+		memcpy(nb + to, _buf + from, at - from);
+		to += at - from;
+		from = at;
+		memcpy(nb + to, b.data, b.len);
+		to += b.len;
+	}
+	memcpy(nb + to, _buf + from, _ind - from);
+	free(_buf);
+	_buf = nb;
+	_capa = capa;
+	_ind = total;
+	_refs.clear();
+	_reflen = 0;
+}
+
+rpc_pdu
+marshall::take_pdu()
+{
+	rpc_pdu pdu;
+	int sz = htonl(_ind + _reflen);
+	memcpy(_buf, &sz, sizeof(sz));
+	std::shared_ptr<const void> owner(_buf, free);
+	int from = 0;
+	for(size_t i = 0; i < _refs.size(); i++){
+		int at = _refs[i].first;
+		if(at > from)
+			pdu.push_back(rpc_bytes(owner, _buf + from, at - from));
+		from = at;
+		pdu.push_back(_refs[i].second);
+	}
+	if(_ind > from)
+		pdu.push_back(rpc_bytes(owner, _buf + from, _ind - from));
+	_buf = NULL;
+	_capa = _ind = _reflen = 0;
+	_refs.clear();
+	return pdu;
 }
 
 marshall &
@@ -896,6 +1211,17 @@ operator<<(marshall &m, const std::string &s)
 	return m;
 }
 
+marshall &
+operator<<(marshall &m, const rpc_bytes &b)
+{
+	m << (unsigned int) b.len;
+	if(b.len < MIN_RPC_REF_SZ)
+		m.rawbytes(b.data, b.len);
+	else
+		m.ref(b);
+	return m;
+}
+
 marshall &
 operator<<(marshall &m, unsigned long long x)
 {
@@ -1033,6 +1359,27 @@ operator>>(unmarshall &u, std::string &s)
 	return u;
 }
 
+unmarshall &
+operator>>(unmarshall &u, std::string_view &s)
+{
+	unsigned sz;
+	u >> sz;
+	if(u.ok())
+		u.rawview(s, sz);
+	return u;
+}
+
+void
+unmarshall::rawview(std::string_view &v, unsigned int n)
+{
+	if((_ind+n) > (unsigned)_sz){
+		_ok = false;
+	} else {
+		v = std::string_view(_buf+_ind, n);
+		_ind += n;
+	}
+}
+
 void
 unmarshall::rawbytes(std::string &ss, unsigned int n)
 {
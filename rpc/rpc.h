@@ -8,6 +8,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "thr_pool.h"
 #include "marshall.h"
@@ -35,6 +40,11 @@ class rpc_const {
 // threaded: multiple threads can be sending RPCs,
 class rpcc : public chanmgr {
 
+	public:
+		// completion of an async_call1(): the RPC's return value (or a
+		// failure) and the reply, positioned after the header
+		typedef std::function<void(int ret, unmarshall &rep)> reply_cb;
+
 	private:
 
 		//manages per rpc info
@@ -48,10 +58,21 @@ class rpcc : public chanmgr {
 			bool done;
 			pthread_mutex_t m;
 			pthread_cond_t c;
+
+			// async calls only: the callback that completes the call,
+			// the request kept for retransmission, the connection it
+			// went out on, and the retry and final deadlines
+			reply_cb cb;
+			rpc_pdu req;
+			connection *ch;
+			int curr_to;
+			struct timespec nextdeadline, finaldeadline;
 		};
 
 		void get_refconn(connection **ch);
 		void update_xid_rep(unsigned int xid);
+		void async_timer();
+		void finish_async(caller *ca, int ret, unmarshall &rep);
 
 		std::atomic_int _count;
 		sockaddr_in dst_;
@@ -72,13 +93,19 @@ class rpcc : public chanmgr {
 		pthread_cond_t destroy_wait_c_;
 
 		std::map<int, caller *> calls_;
+
+		// times out and retransmits async calls; started by the first one
+		pthread_t timer_th_;
+		bool timer_started_;
+		bool timer_stop_;
+		pthread_cond_t timer_c_;
 		std::list<unsigned int> xid_rep_window_;
                 
                 struct request {
                     request() { clear(); }
                     void clear() { buf.clear(); xid = -1; }
                     bool isvalid() { return xid != -1; }
-                    std::string buf;
+                    rpc_pdu buf;
                     int xid;
                 };
                 struct request dup_req_;
@@ -93,6 +120,8 @@ class rpcc : public chanmgr {
 		};
 		static const TO to_max;
 		static const TO to_min;
+		// how often a waiting call checks whether its connection died
+		static const TO to_poll;
 		static TO to(int x) { TO t; t.to = x; return t;}
 
 		unsigned int id() { return clt_nonce_; }
@@ -113,6 +142,20 @@ class rpcc : public chanmgr {
 
 		bool got_pdu(connection *c, char *b, int sz);
 
+		// Send a request and return at once.  cb runs exactly once, on
+		// the PollMgr thread when the reply arrives (so it must not
+		// block), or on an rpcc thread if the call fails or times out.
+		void async_call1(unsigned int proc, marshall &req, reply_cb cb, TO to);
+
+		// async_call<R>(proc, cb, args...) runs cb(ret, reply) as above.
+		template<class R, class... Args>
+			void async_call(unsigned int proc,
+					std::function<void(int, R &)> cb, const Args &... args);
+		// async_call(proc, &r, args...) stores the reply in r, which must
+		// outlive the call, and resolves the future to the return value.
+		template<class R, class... Args>
+			std::future<int> async_call(unsigned int proc, R *r, const Args &... args);
+
 
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
@@ -164,6 +207,41 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 	return intret;
 }
 
+template<class R, class... Args> void
+rpcc::async_call(unsigned int proc, std::function<void(int, R &)> cb,
+		const Args &... args)
+{
+	marshall m;
+	(void) std::initializer_list<int>{ (m << args, 0)... };
+	_count.fetch_add(1);
+	async_call1(proc, m, [proc, cb](int ret, unmarshall &u) {
+		R r;
+		if (ret >= 0) {
+			u >> r;
+			if (u.okdone() != true) {
+				fprintf(stderr, "rpcc::async_call: failed to unmarshall the reply."
+				       "You are probably calling RPC 0x%x with wrong return "
+				       "type.\n", proc);
+				VERIFY(0);
+			}
+		}
+		cb(ret, r);
+	}, to_max);
+}
+
+template<class R, class... Args> std::future<int>
+rpcc::async_call(unsigned int proc, R *r, const Args &... args)
+{
+	std::shared_ptr<std::promise<int> > done(new std::promise<int>);
+	std::future<int> f = done->get_future();
+	async_call<R>(proc, [r, done](int ret, R &rep) {
+		if (ret >= 0)
+			*r = std::move(rep);
+		done->set_value(ret);
+	}, args...);
+	return f;
+}
+
 template<class R> int
 rpcc::call(unsigned int proc, R & r, TO to) 
 {
@@ -283,19 +361,16 @@ class rpcs : public chanmgr {
 
         // state about an in-progress or completed RPC, for at-most-once.
         // if cb_present is true, then the RPC is complete and a reply
-        // has been sent; in that case buf points to a copy of the reply,
-        // and sz holds the size of the reply.
+        // has been sent; in that case buf holds the reply, shared with
+        // the connection until it has been written out.
 	struct reply_t {
 		reply_t (unsigned int _xid) {
 			xid = _xid;
 			cb_present = false;
-			buf = NULL;
-			sz = 0;
 		}
 		unsigned int xid;
 		bool cb_present; // whether the reply buffer is valid
-		char *buf;      // the reply buffer
-		int sz;         // the size of reply buffer
+		rpc_pdu buf;    // the reply
 	};
 
 	int port_;
@@ -307,11 +382,11 @@ class rpcs : public chanmgr {
 	std::map<unsigned int, std::list<reply_t> > reply_window_;
 
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	void add_reply(unsigned int clt_nonce, unsigned int xid, const rpc_pdu &b);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
 			unsigned int xid, unsigned int rep_xid,
-			char **b, int *sz);
+			rpc_pdu *b);
 
 	void updatestat(unsigned int proc);
 
@@ -373,7 +448,8 @@ class rpcs : public chanmgr {
 
 	void unreg_all();
 	
-	// register a handler
+	// register a handler.  Unmarshalled arguments are moved into meth;
+	// a std::string_view argument points into the request itself.
 	template<class S, class A1, class R>
 		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
 	template<class S, class A1, class A2, class R>
@@ -418,7 +494,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
 				args >> a1;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, r);
+				int b = (sob->*meth)(std::move(a1), r);
 				ret << r;
 				return b;
 			}
@@ -445,7 +521,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				args >> a2;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, r);
+				int b = (sob->*meth)(std::move(a1), std::move(a2), r);
 				ret << r;
 				return b;
 			}
@@ -474,7 +550,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				args >> a3;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, r);
+				int b = (sob->*meth)(std::move(a1), std::move(a2), std::move(a3), r);
 				ret << r;
 				return b;
 			}
@@ -507,7 +583,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				args >> a4;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, r);
+				int b = (sob->*meth)(std::move(a1), std::move(a2), std::move(a3), std::move(a4), r);
 				ret << r;
 				return b;
 			}
@@ -543,7 +619,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				args >> a5;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
+				int b = (sob->*meth)(std::move(a1), std::move(a2), std::move(a3), std::move(a4), std::move(a5), r);
 				ret << r;
 				return b;
 			}
@@ -582,7 +658,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				args >> a6;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
+				int b = (sob->*meth)(std::move(a1), std::move(a2), std::move(a3), std::move(a4), std::move(a5), std::move(a6), r);
 				ret << r;
 				return b;
 			}
@@ -625,7 +701,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				args >> a7;
 				if(!args.okdone())
 					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
+				int b = (sob->*meth)(std::move(a1), std::move(a2), std::move(a3), std::move(a4), std::move(a5), std::move(a6), std::move(a7), r);
 				ret << r;
 				return b;
 			}
@@ -14,7 +14,7 @@ do_worker(void *arg)
 		if (!tp->takeJob(&j))
 			break; //die
 
-		(void)(j.f)(j.a);
+		(j.f)(&j);
 	}
 	pthread_exit(NULL);
 }
@@ -22,8 +22,11 @@ do_worker(void *arg)
 //if blocking, then addJob() blocks when queue is full
 //otherwise, addJob() simply returns false when queue is full
 ThrPool::ThrPool(int sz, bool blocking)
-: nthreads_(sz),blockadd_(blocking),jobq_(100*sz) 
+: nthreads_(sz),blockadd_(blocking),jobq_(100*sz),idle_(0),full_(0)
 {
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&non_empty_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&has_space_c_, 0) == 0);
 	pthread_attr_init(&attr_);
 	pthread_attr_setstacksize(&attr_, 128<<10);
 	stopped = false;
@@ -39,22 +42,63 @@ ThrPool::ThrPool(int sz, bool blocking)
 ThrPool::~ThrPool()
 {
 	destroy();
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_cond_destroy(&non_empty_c_) == 0);
+	VERIFY(pthread_cond_destroy(&has_space_c_) == 0);
 }
 
+// A thread that goes to sleep first announces itself (idle_, full_) and
+// then checks the ring again, while the other side first changes the
+// ring and then checks for sleepers, with a full fence between the two
+// steps on both sides.  So either the sleeper sees the change or the
+// other side sees the sleeper, and wakes it under m_, which the sleeper
+// holds until it waits.
 bool 
-ThrPool::addJob(void *(*f)(void *), void *a)
+ThrPool::addJob(const job_t &j, bool blocking)
 {
-	job_t j;
-	j.f = f;
-	j.a = a;
+	if (jobq_.enq(j)) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (idle_.load() > 0) {
+			ScopedLock ml(&m_);
+			VERIFY(pthread_cond_signal(&non_empty_c_) == 0);
+		}
+		return true;
+	}
+	if (!blocking)
+		return false;
 
-	return jobq_.enq(j,blockadd_);
+	ScopedLock ml(&m_);
+	full_++;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	while (!jobq_.enq(j))
+		VERIFY(pthread_cond_wait(&has_space_c_, &m_) == 0);
+	full_--;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (idle_.load() > 0)
+		VERIFY(pthread_cond_signal(&non_empty_c_) == 0);
+	return true;
 }
 
 bool 
 ThrPool::takeJob(job_t *j)
 {
-	jobq_.deq(j);
+	if (jobq_.deq(j)) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (full_.load() > 0) {
+			ScopedLock ml(&m_);
+			VERIFY(pthread_cond_signal(&has_space_c_) == 0);
+		}
+	} else {
+		ScopedLock ml(&m_);
+		idle_++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!jobq_.deq(j))
+			VERIFY(pthread_cond_wait(&non_empty_c_, &m_) == 0);
+		idle_--;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (full_.load() > 0)
+			VERIFY(pthread_cond_signal(&has_space_c_) == 0);
+	}
 	return (j->f!=NULL);
 }
 
@@ -62,11 +106,12 @@ void
 ThrPool::destroy()
 {
 	if (stopped) return;
-	jobq_.clear();
+	job_t j;
+	while (jobq_.deq(&j))
+		;
 	for (int i = 0; i < nthreads_; i++) {
-		job_t j;
-		j.f = (void *(*)(void *))NULL; //poison pill to tell worker threads to exit
-		jobq_.enq(j);
+		j.f = NULL; //poison pill to tell worker threads to exit
+		addJob(j, true);
 	}
 
 	for (int i = 0; i < nthreads_; i++) {
@@ -2,17 +2,31 @@
 #define __THR_POOL__
 
 #include <pthread.h>
+#include <stddef.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
 #include <vector>
 
-#include "fifo.h"
+#include "mpmc.h"
 
+// bytes a job keeps for its object, method and arguments
+#define JOB_ARG_SZ 64
+
+// Jobs sit in a lock-free ring and carry their arguments inline, so
+// adding a job neither allocates nor takes a lock unless a worker is
+// asleep.  Workers only sleep, on a condition variable, once the ring
+// is empty; addJob() wakes one if any are sleeping.
 class ThrPool {
 
 
 	public:
 		struct job_t {
-			void *(*f)(void *); //function point
-			void *a; //function arguments
+			void (*f)(job_t *); //function point, NULL tells a worker to exit
+			union {
+				char a[JOB_ARG_SZ]; //function arguments
+				max_align_t align_;
+			};
 		};
 
 		ThrPool(int sz, bool blocking=true);
@@ -31,10 +45,30 @@ class ThrPool {
 		bool blockadd_;
 		bool stopped;
 
-		fifo<job_t> jobq_;
+		mpmc<job_t> jobq_;
 		std::vector<pthread_t> th_;
 
-		bool addJob(void *(*f)(void *), void *a);
+		// sleeping workers and adders wait here
+		pthread_mutex_t m_;
+		pthread_cond_t non_empty_c_;
+		pthread_cond_t has_space_c_;
+		std::atomic<int> idle_;   // workers asleep or about to be
+		std::atomic<int> full_;   // adders waiting for space
+
+		bool addJob(const job_t &j, bool blocking);
+
+		// Copy w into a job that runs W::func; W must fit in JOB_ARG_SZ
+		// and be trivially copyable, as jobs are copied in and out of
+		// the ring.
+		template<class W> bool addWrapped(const W &w) {
+			static_assert(sizeof(W) <= JOB_ARG_SZ, "job arguments too big");
+			static_assert(std::is_trivially_copyable<W>::value,
+					"job arguments must be trivially copyable");
+			job_t j;
+			j.f = &W::func;
+			new (j.a) W(w);
+			return addJob(j, blockadd_);
+		}
 };
 
 	template <class C, class A> bool 
@@ -45,22 +79,20 @@ ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 			C *o;
 			void (C::*m)(A a);
 			A a;
-			static void *func(void *vvv) {
-				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
+			static void func(job_t *j) {
+				objfunc_wrapper *x = (objfunc_wrapper*)j->a;
 				C *o = x->o;
 				void (C::*m)(A ) = x->m;
 				A a = x->a;
 				(o->*m)(a);
-				delete x;
-				return 0;
 			}
 	};
 
-	objfunc_wrapper *x = new objfunc_wrapper;
-	x->o = o;
-	x->m = m;
-	x->a = a;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	objfunc_wrapper x;
+	x.o = o;
+	x.m = m;
+	x.a = a;
+	return addWrapped(x);
 }
 
 	template<class C, class A0, class A1> bool 
@@ -72,24 +104,22 @@ ThrPool::addObjJob(C *o, void (C::*m)(A0, A1), A0 a0, A1 a1)
 			void (C::*m)(A0 a0, A1 a1);
 			A0 a0;
 			A1 a1;
-			static void *func(void *vvv) {
-				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
+			static void func(job_t *j) {
+				objfunc_wrapper *x = (objfunc_wrapper*)j->a;
 				C *o = x->o;
 				void (C::*m)(A0 a0, A1 a1) = x->m;
 				A0 a0 = x->a0;
 				A1 a1 = x->a1;
 				(o->*m)(a0, a1);
-				delete x;
-				return 0;
 			}
 	};
 
-	objfunc_wrapper *x = new objfunc_wrapper;
-	x->o = o;
-	x->m = m;
-	x->a0 = a0;
-	x->a1 = a1;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	objfunc_wrapper x;
+	x.o = o;
+	x.m = m;
+	x.a0 = a0;
+	x.a1 = a1;
+	return addWrapped(x);
 }
 
 	template<class C, class A0, class A1, class A2> bool 
@@ -102,26 +132,24 @@ ThrPool::addObjJob(C *o, void (C::*m)(A0, A1, A2), A0 a0, A1 a1, A2 a2)
 			A0 a0;
 			A1 a1;
 			A2 a2;
-			static void *func(void *vvv) {
-				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
+			static void func(job_t *j) {
+				objfunc_wrapper *x = (objfunc_wrapper*)j->a;
 				C *o = x->o;
 				void (C::*m)(A0 a0, A1 a1, A2 a2) = x->m;
 				A0 a0 = x->a0;
 				A1 a1 = x->a1;
 				A2 a2 = x->a2;
 				(o->*m)(a0, a1, a2);
-				delete x;
-				return 0;
 			}
 	};
 
-	objfunc_wrapper *x = new objfunc_wrapper;
-	x->o = o;
-	x->m = m;
-	x->a0 = a0;
-	x->a1 = a1;
-	x->a2 = a2;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	objfunc_wrapper x;
+	x.o = o;
+	x.m = m;
+	x.a0 = a0;
+	x.a1 = a1;
+	x.a2 = a2;
+	return addWrapped(x);
 }
 
 template<class C, class A0, class A1, class A2, class A3> bool 
@@ -135,8 +163,8 @@ ThrPool::addObjJob(C *o, void (C::*m)(A0, A1, A2, A3), A0 a0, A1 a1, A2 a2, A3 a
 			A1 a1;
 			A2 a2;
 			A3 a3;
-			static void *func(void *vvv) {
-				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
+			static void func(job_t *j) {
+				objfunc_wrapper *x = (objfunc_wrapper*)j->a;
 				C *o = x->o;
 				void (C::*m)(A0 a0, A1 a1, A2 a2, A3 a3) = x->m;
 				A0 a0 = x->a0;
@@ -144,19 +172,17 @@ ThrPool::addObjJob(C *o, void (C::*m)(A0, A1, A2, A3), A0 a0, A1 a1, A2 a2, A3 a
 				A2 a2 = x->a2;
 				A3 a3 = x->a3;
 				(o->*m)(a0, a1, a2, a3);
-				delete x;
-				return 0;
 			}
 	};
 
-	objfunc_wrapper *x = new objfunc_wrapper;
-	x->o = o;
-	x->m = m;
-	x->a0 = a0;
-	x->a1 = a1;
-	x->a2 = a2;
-	x->a3 = a3;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	objfunc_wrapper x;
+	x.o = o;
+	x.m = m;
+	x.a0 = a0;
+	x.a1 = a1;
+	x.a2 = a2;
+	x.a3 = a3;
+	return addWrapped(x);
 }
 
 #endif
@@ -117,9 +117,15 @@ int main(int argc, char *argv[]) {
     es_rg = new extent_server_dist(NUM_NODES);
     server.reg(extent_protocol::get, es_rg, &extent_server_dist::get);
     server.reg(extent_protocol::getattr, es_rg, &extent_server_dist::getattr);
+    server.reg(extent_protocol::getattr_lease, es_rg, &extent_server_dist::getattr_lease);
+    server.reg(extent_protocol::getattr_many, es_rg, &extent_server_dist::getattr_many);
     server.reg(extent_protocol::put, es_rg, &extent_server_dist::put);
     server.reg(extent_protocol::remove, es_rg, &extent_server_dist::remove);
     server.reg(extent_protocol::create, es_rg, &extent_server_dist::create);
+    server.reg(extent_protocol::read, es_rg, &extent_server_dist::read);
+    server.reg(extent_protocol::write, es_rg, &extent_server_dist::write);
+    server.reg(extent_protocol::truncate, es_rg, &extent_server_dist::truncate);
+    server.reg(extent_protocol::compound, es_rg, &extent_server_dist::compound);
 
     chfs_c = new chfs_client(extent_port);
 